@@ -15,12 +15,26 @@ static void autostr_empty(autostr_t *a, char reallocate)
     a->ptr[0] = '\0';
 }
 
+/* Used to make room for a string of `len` characters.  The allocated space
+   doubles as needed, so appending runs in amortized constant time. */
+static void autostr_grow(autostr_t *a, size_t len)
+{
+    size_t new_size = a->size;
+    while (new_size <= len) {
+        new_size *= 2;
+    }
+    if (new_size > a->size) {
+        a->ptr = realloc(a->ptr, new_size);
+        a->size = new_size;
+    }
+}
+
 /* Used by autostr_*trim to reduce the allocated space, if possible. */
 static void autostr_shrink(autostr_t *a)
 {
     size_t new_size = a->size;
-    while (new_size - AUTOSTR_CHUNK > a->len) {
-        new_size -= AUTOSTR_CHUNK;
+    while (new_size / 2 > a->len && new_size / 2 >= AUTOSTR_CHUNK) {
+        new_size /= 2;
     }
     if (new_size < a->size) {
         a->ptr = realloc(a->ptr, new_size);
@@ -48,6 +62,19 @@ void autostr_free(autostr_t **a)
     }
 }
 
+char *autostr_release(autostr_t **a, char shrink)
+{
+    char *ptr = (*a)->ptr;
+    
+    if (shrink && (*a)->size > (*a)->len + 1) {
+        ptr = realloc(ptr, (*a)->len + 1);
+    }
+    free(*a);
+    *a = NULL;
+    
+    return ptr;
+}
+
 const char *autostr_value(autostr_t *a)
 {
     return a->ptr;
@@ -69,30 +96,42 @@ autostr_t *autostr_recycle(autostr_t **a)
     return *a;
 }
 
+autostr_t *autostr_clear(autostr_t *a)
+{
+    a->len = 0;
+    a->ptr[0] = '\0';
+    
+    return a;
+}
+
+autostr_t *autostr_reserve(autostr_t *a, size_t len)
+{
+    autostr_grow(a, len);
+    
+    return a;
+}
+
 autostr_t *autostr_append(autostr_t *a, const char *append)
 {
-    size_t new_len = a->len + strlen(append);
-    char reallocate = 0;
-    while (a->size <= new_len) {
-        a->size += AUTOSTR_CHUNK;
-        reallocate = 1;
-    }
-    if (reallocate) {
-        a->ptr = realloc(a->ptr, a->size);
-    }
-    strcpy(a->ptr + a->len, append);
-    a->len = new_len;
+    return autostr_append_len(a, append, strlen(append));
+}
+
+autostr_t *autostr_append_len(autostr_t *a, const char *append, size_t len)
+{
+    autostr_grow(a, a->len + len);
+    memcpy(a->ptr + a->len, append, len);
+    a->len += len;
+    a->ptr[a->len] = '\0';
     
     return a;
 }
 
 autostr_t *autostr_push(autostr_t *a, char push)
 {
-    if (++a->len == a->size) {
-        a->size += AUTOSTR_CHUNK;
-        a->ptr = realloc(a->ptr, a->size);
+    if (a->len + 1 == a->size) {
+        autostr_grow(a, a->len + 1);
     }
-    a->ptr[a->len - 1] = push;
+    a->ptr[a->len++] = push;
     a->ptr[a->len] = '\0';
     
     return a;
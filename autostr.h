@@ -4,8 +4,8 @@
 #include <stdlib.h>
 
 /**
- * Initial size to allocate for each instance's char pointer, and size by which
- * to increase or decrease the allocated space when more or less is needed.
+ * Initial size to allocate for each instance's char pointer.  The allocated
+ * space doubles when more is needed.
  */
 #define AUTOSTR_CHUNK 256
 
@@ -29,6 +29,13 @@ autostr_t *autostr();
  */
 void autostr_free(autostr_t **a);
 
+/**
+ * Deallocate the instance, set the pointer to NULL and return its string
+ * without copying it.  The caller becomes responsible for freeing the string.
+ * If `shrink` is nonzero, unused space is returned to the allocator first.
+ */
+char *autostr_release(autostr_t **a, char shrink);
+
 /**
  * Get the instance's string.
  */
@@ -45,11 +52,29 @@ int autostr_len(autostr_t *a);
  */
 autostr_t *autostr_recycle(autostr_t **a);
 
+/**
+ * Reset the instance to a blank string without giving up its memory, for
+ * strings that are reused as scratch space.
+ */
+autostr_t *autostr_clear(autostr_t *a);
+
+/**
+ * Make sure the instance can hold a string of `len` characters without
+ * reallocating.
+ */
+autostr_t *autostr_reserve(autostr_t *a, size_t len);
+
 /**
  * Append a string to the instance.
  */
 autostr_t *autostr_append(autostr_t *a, const char *append);
 
+/**
+ * Append `len` characters to the instance.  The characters don't need to be
+ * NUL-terminated.
+ */
+autostr_t *autostr_append_len(autostr_t *a, const char *append, size_t len);
+
 /**
  * Append a single char to the instance.
  */
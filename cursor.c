@@ -3,13 +3,12 @@
 #include "autostr.h"
 #include "cursor.h"
 
-cursor_t *cursor(const char *buffer)
+cursor_t *cursor(const char *buffer, size_t len)
 {
     cursor_t *c = malloc(sizeof(cursor_t));
     c->buffer = buffer;
+    c->len = len;
     c->offset = 0;
-    c->line = 1;
-    c->column = 1;
     
     return c;
 }
@@ -21,28 +20,45 @@ void cursor_free(cursor_t **c)
 
 #if !(CURSOR_MACROS)
 size_t cursor_offset(cursor_t *c) { return c->offset; }
-size_t cursor_line(cursor_t *c) { return c->line; }
-size_t cursor_column(cursor_t *c) { return c->column; }
-char cursor_peek(cursor_t *c) { return c->buffer[c->offset]; }
+char cursor_peek(cursor_t *c) { return c->offset < c->len ? c->buffer[c->offset] : '\0'; }
+size_t cursor_remaining(cursor_t *c) { return c->len - c->offset; }
+const char *cursor_pointer(cursor_t *c) { return c->buffer + c->offset; }
+void cursor_move(cursor_t *c, size_t chars) { c->offset += chars; }
 #endif // !(CURSOR_MACROS)
 
 char cursor_read(cursor_t *c)
 {
-    char ch = cursor_peek(c);
+    return c->offset < c->len ? c->buffer[c->offset++] : '\0';
+}
+
+size_t cursor_line(cursor_t *c)
+{
+    return cursor_line_at(c->buffer, c->offset);
+}
+
+size_t cursor_column(cursor_t *c)
+{
+    return cursor_column_at(c->buffer, c->offset);
+}
+
+size_t cursor_line_at(const char *buffer, size_t offset)
+{
+    size_t i, line = 1;
     
-    if (ch == '\n') {
-        c->line += 1;
-        c->column = 0;
+    for (i = 0; i < offset; i++) {
+        if (buffer[i] == '\n') line++;
     }
-    c->offset += 1;
-    c->column += 1;
     
-    return ch;
+    return line;
 }
 
-void cursor_move(cursor_t *c, size_t chars)
+size_t cursor_column_at(const char *buffer, size_t offset)
 {
-    while (chars--) {
-        cursor_read(c);
+    size_t line_start = offset;
+    
+    while (line_start && buffer[line_start - 1] != '\n') {
+        line_start--;
     }
-}
\ No newline at end of file
+    
+    return offset - line_start + 1;
+}
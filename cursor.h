@@ -3,35 +3,52 @@
 
 #define CURSOR_MACROS 1
 
+/**
+ * A read position in a buffer of `len` bytes, which needn't be NUL-terminated.
+ * Reading at the end of the buffer yields '\0' without moving the cursor, so
+ * parsers can treat the end as a terminator without one being stored.  Only
+ * the byte offset is tracked; line and column numbers are worked out from the
+ * buffer when they are asked for, which normally only happens when an error is
+ * reported.
+ */
 typedef struct {
     const char *buffer;
+    size_t len;
     size_t offset;
-    size_t line;
-    size_t column;
 } cursor_t;
 
 // Constructors / destructors:
 
-cursor_t *cursor(const char *buffer);
+cursor_t *cursor(const char *buffer, size_t len);
 void cursor_free(cursor_t **c);
 
 // Getters:
 
 #if CURSOR_MACROS
 #define cursor_offset(c) ((c)->offset)
-#define cursor_line(c) ((c)->line)
-#define cursor_column(c) ((c)->column)
-#define cursor_peek(c) ((c)->buffer[(c)->offset])
+#define cursor_peek(c) ((c)->offset < (c)->len ? (c)->buffer[(c)->offset] : '\0')
+#define cursor_remaining(c) ((c)->len - (c)->offset)
+#define cursor_pointer(c) ((c)->buffer + (c)->offset)
 #else // CURSOR_MACROS
 size_t cursor_offset(cursor_t *c);
-size_t cursor_line(cursor_t *c);
-size_t cursor_column(cursor_t *c);
 char cursor_peek(cursor_t *c);
+size_t cursor_remaining(cursor_t *c);
+const char *cursor_pointer(cursor_t *c);
 #endif // CURSOR_MACROS
 
+size_t cursor_line(cursor_t *c);
+size_t cursor_column(cursor_t *c);
+size_t cursor_line_at(const char *buffer, size_t offset);
+size_t cursor_column_at(const char *buffer, size_t offset);
+
 // Other methods:
 
 char cursor_read(cursor_t *c);
+
+#if CURSOR_MACROS
+#define cursor_move(c, chars) ((c)->offset += (chars))
+#else // CURSOR_MACROS
 void cursor_move(cursor_t *c, size_t chars);
+#endif // CURSOR_MACROS
 
-#endif // CURSOR_H
\ No newline at end of file
+#endif // CURSOR_H
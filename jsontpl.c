@@ -1,6 +1,19 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif // _WIN32
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
 
 #if defined(JSONTPL_MAIN) && defined(_WIN32)
 #include <io.h>
@@ -10,729 +23,1107 @@
 #include <jansson.h>
 
 #include "autostr.h"
-#include "cursor.h"
 #include "jsontpl.h"
+#include "jsontpl_compile.h"
 #include "jsontpl_filter.h"
+#include "jsontpl_pool.h"
+#include "jsontpl_project.h"
+#include "jsontpl_render.h"
+#include "jsontpl_server.h"
 #include "jsontpl_util.h"
 #include "output.h"
 #include "verify.h"
 
 /**
- * Parse the template.  This function is responsible for writing literal text
- * and escape sequences to the output.  Values and blocks are passed to
- * parse_value and parse_block, respectively.
+ * The contents of a file, mapped into memory where possible and read into a
+ * buffer otherwise.  Mapped contents aren't NUL-terminated.
  */
-static int parse_template(
-        cursor_t *c,
-        json_t *context,
-        jsontpl_scope scope,
-        output_t *out);
+typedef struct {
+    char *data;
+    size_t len;
+    char mapped;
+} file_contents_t;
+
+struct jsontpl_template {
+    // The program's text instructions point into the source.
+    file_contents_t source;
+    jsontpl_program_t *program;
+    // The parts of the JSON input the program needs, or NULL for all of it.
+    jsontpl_paths_t *paths;
+    jsontpl_parallel_t parallel;
+};
 
 #undef verify_cleanup
-#define verify_cleanup
+#define verify_cleanup if (template_file) fclose(template_file)
 /**
- * Discard spaces and tabs and set the cursor to the first non-blank character.
+ * Read a whole file into a newly allocated, NUL-terminated buffer.  If `len`
+ * is not NULL, it is set to the file's size.
  */
-static int discard_blank(cursor_t *c)
+static int read_file(const char *filename, char **buffer, size_t *len)
 {
-    char ch;
+    long filesize_ftell;
+    size_t filesize_fread;
+    FILE *template_file = NULL;
     
-    while ((ch = cursor_peek(c)) != '\0') {
-        if (isblank(ch)) {
-            cursor_read(c);
-        } else {
-            verify_return();
-        }
-    }
+    // Open template file
+    template_file = fopen(filename, "rb");
+    verify(template_file != NULL, "%s: no such file", filename);
+    
+    // Get file size
+    fseek(template_file, 0, SEEK_END);
+    filesize_ftell = ftell(template_file);
+    verify_bare(filesize_ftell != -1L);
+    rewind(template_file);
+    
+    // Read template into memory
+    *buffer = malloc(filesize_ftell + 1);
+    (*buffer)[filesize_ftell] = '\0';
+    filesize_fread = fread(*buffer, 1, filesize_ftell, template_file);
+    verify_bare(filesize_ftell == filesize_fread);
+    if (len) *len = filesize_fread;
     
-    /* EOF is certainly an error here, but let the caller decide on the error
-       message, because "EOF encountered while discarding whitespace" wouldn't
-       be terribly helpful. */
     verify_return();
 }
 
 #undef verify_cleanup
+#ifndef _WIN32
+#define verify_cleanup if (fd != -1) close(fd)
+#else // _WIN32
 #define verify_cleanup
+#endif // _WIN32
 /**
- * Discard characters until the sequence is found and set the cursor to the
- * first character following the sequence.
+ * Map a whole file into memory read-only, so it can be parsed in place without
+ * being copied.  Files that can't be mapped, such as empty files, and files on
+ * platforms without mmap are read into a buffer instead.
  */
-static int discard_until(cursor_t *c, const char *seq)
+static int open_file(const char *filename, file_contents_t *contents)
 {
-    char ch;
-    size_t seq_index = 0;
+#ifndef _WIN32
+    int fd = -1;
+    struct stat st;
+    void *data;
     
-    while ((ch = cursor_peek(c)) != '\0') {
-        
-        if (seq[seq_index] == '\0') {
+    fd = open(filename, O_RDONLY);
+    verify(fd != -1, "%s: no such file", filename);
+    verify_bare(fstat(fd, &st) == 0);
+    
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            contents->data = data;
+            contents->len = st.st_size;
+            contents->mapped = 1;
             verify_return();
         }
-        
-        if (ch == seq[seq_index]) {
-            seq_index++;
-        } else {
-            seq_index = 0;
-        }
-        
-        cursor_read(c);
     }
+#endif // _WIN32
     
-    verify_fail("expected '%s', got EOF", seq);
+    verify_call(read_file(filename, &contents->data, &contents->len));
+    contents->mapped = 0;
+    
+    verify_return();
+}
+
+static void close_file(file_contents_t *contents)
+{
+#ifndef _WIN32
+    if (contents->mapped) {
+        munmap(contents->data, contents->len);
+    } else
+#endif // _WIN32
+    free(contents->data);
+    contents->data = NULL;
 }
 
 #undef verify_cleanup
 #define verify_cleanup
 /**
- * Read a sequence from the template, or raise an error if something other than
- * the given sequence is read.
+ * Read the next line of the file, including its line ending, into `line`,
+ * which keeps its capacity between calls.  `eof` is set instead if there are
+ * no more lines.
  */
-static int parse_seq(cursor_t *c, const char *seq)
+static int read_line(FILE *input, autostr_t *line, char *eof)
 {
-    char ch;
-    size_t seq_index = 0;
+    char chunk[4096];
+    size_t len;
     
-    verify_call(discard_blank(c));
+    autostr_clear(line);
+    *eof = 1;
     
-    while ((ch = cursor_read(c)) != '\0') {
-        
-        verify(ch == seq[seq_index], "expected '%s', got '%c'", seq, ch);
-        seq_index++;
-        
-        if (seq[seq_index] == '\0') {
-            verify_return();
-        }
+    while (fgets(chunk, sizeof(chunk), input)) {
+        *eof = 0;
+        len = strlen(chunk);
+        autostr_append_len(line, chunk, len);
+        if (len && chunk[len - 1] == '\n') break;
     }
+    verify(!ferror(input), "error reading input");
     
-    verify_fail("expected '%s', got EOF", seq);
+    verify_return();
 }
 
 #undef verify_cleanup
-#define verify_cleanup autostr_trim(identifier)
+#define verify_cleanup
 /**
- * Read an identifier (containing alphanumeric characters and underscores) from
- * the template and store it in `identifier`, or raise an error if the first
- * (non-blank) character is not an identifier character.
+ * Render the template to an output of either type.
  */
-static int parse_identifier(
-        cursor_t *c,
-        autostr_t *identifier)
+static int render_output(jsontpl_template_t *tpl, json_t *root, output_t *out)
 {
-    char ch;
-    char seen_ident = 0;
+    verify(json_is_object(root), "root is not an object");
+    verify_call(jsontpl_render_program(tpl->program, &tpl->parallel, root, out));
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_program_free(&program);                                         \
+    jsontpl_paths_free(&paths);                                             \
+} while (0)
+/**
+ * Compile the source and assign `tpl` to a new template, which takes ownership
+ * of the source if compilation succeeds.
+ */
+static int template_compile(
+        const jsontpl_env_t *env,
+        file_contents_t *source,
+        jsontpl_template_t **tpl)
+{
+    jsontpl_program_t *program = NULL;
+    jsontpl_paths_t *paths = NULL;
     
-    verify_call(discard_blank(c));
+    verify_call(jsontpl_compile_program(source->data, source->len, env, &program));
+    verify_call(jsontpl_paths_build(program, &paths));
     
-    while ((ch = cursor_peek(c)) != '\0') {
-        
-        if (isident(ch)) {
-            seen_ident = 1;
-            autostr_push(identifier, cursor_read(c));
-        } else {
-            verify(seen_ident, "expected an identifier, got '%c'", ch);
-            verify_call(discard_blank(c));
-            verify_return();
+    *tpl = malloc(sizeof(jsontpl_template_t));
+    (*tpl)->source = *source;
+    (*tpl)->program = program;
+    source->data = NULL;
+    (*tpl)->paths = paths;
+    (*tpl)->parallel.pool = NULL;
+    (*tpl)->parallel.min_items = 0;
+    program = NULL;
+    paths = NULL;
+    
+    verify_return();
+}
+
+
+/* Public functions: */
+
+
+jsontpl_env_t *jsontpl_env_new(void)
+{
+    return calloc(1, sizeof(jsontpl_env_t));
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+int jsontpl_env_add_filter(
+        jsontpl_env_t *env,
+        const char *name,
+        unsigned types,
+        jsontpl_filter_func_t func,
+        jsontpl_filter_write_t write)
+{
+    verify_call_code(jsontpl_filter_register(env, name, types, func, write),
+        JSONTPL_ERROR_FILTER);
+    verify_return();
+}
+
+void jsontpl_env_free(jsontpl_env_t **env)
+{
+    size_t i;
+    
+    if (*env) {
+        for (i = 0; i < (*env)->len; i++) {
+            free((char *)(*env)->filters[i]->name);
+            free((*env)->filters[i]);
         }
+        free((*env)->filters);
+        free(*env);
+        *env = NULL;
     }
+}
+
+void jsontpl_output_write(jsontpl_output_t *output, const char *str, size_t len)
+{
+    output_write(output, str, len);
+}
+
+int jsontpl_template_compile(const char *template, jsontpl_template_t **tpl)
+{
+    return jsontpl_template_compile_env(NULL, template, tpl);
+}
+
+#undef verify_cleanup
+#define verify_cleanup close_file(&source)
+int jsontpl_template_compile_env(
+        const jsontpl_env_t *env,
+        const char *template,
+        jsontpl_template_t **tpl)
+{
+    size_t len = strlen(template);
+    file_contents_t source = {malloc(len + 1), len, 0};
+    
+    /* Copy the terminator too, so the private source is a C string like the
+       template it was made from */
+    memcpy(source.data, template, len + 1);
+    verify_call_code(template_compile(env, &source, tpl), JSONTPL_ERROR_COMPILE);
     
-    verify_fail("EOF while reading identifier");
+    verify_return();
+}
+
+int jsontpl_template_load(const char *template_filename, jsontpl_template_t **tpl)
+{
+    return jsontpl_template_load_env(NULL, template_filename, tpl);
 }
 
 #undef verify_cleanup
-#define verify_cleanup autostr_free(&filter_name)
-/**
- * Read a filter name from the template and process `obj` with that filter.
- */
-int parse_filter(cursor_t *c, json_t **obj)
+#define verify_cleanup close_file(&template)
+int jsontpl_template_load_env(
+        const jsontpl_env_t *env,
+        const char *template_filename,
+        jsontpl_template_t **tpl)
+{
+    file_contents_t template = {NULL, 0, 0};
+    
+    verify_call_code(open_file(template_filename, &template), JSONTPL_ERROR_LOAD);
+    verify_call_code(template_compile(env, &template, tpl), JSONTPL_ERROR_COMPILE);
+    
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup close_file(&template)
+int jsontpl_template_read_env(
+        const jsontpl_env_t *env,
+        const char *template_filename,
+        jsontpl_template_t **tpl)
+{
+    file_contents_t template = {NULL, 0, 0};
+    
+    verify_call_code(read_file(template_filename, &template.data, &template.len),
+        JSONTPL_ERROR_LOAD);
+    verify_call_code(template_compile(env, &template, tpl), JSONTPL_ERROR_COMPILE);
+    
+    verify_return();
+}
+
+void jsontpl_template_set_pool(
+        jsontpl_template_t *tpl,
+        jsontpl_pool_t *pool,
+        size_t min_items)
+{
+    tpl->parallel.pool = pool;
+    tpl->parallel.min_items = min_items;
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+int jsontpl_template_parse_json(
+        jsontpl_template_t *tpl,
+        const char *json,
+        size_t len,
+        json_t **root)
+{
+    verify_call_code(jsontpl_paths_load(tpl->paths, json, len, root),
+        JSONTPL_ERROR_LOAD);
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup close_file(&json)
+int jsontpl_template_load_json(
+        jsontpl_template_t *tpl,
+        const char *json_filename,
+        json_t **root)
 {
-    autostr_t *filter_name = autostr();
+    file_contents_t json = {NULL, 0, 0};
     
-    verify_call(parse_identifier(c, filter_name));
-    verify_call(jsontpl_filter(filter_name, obj));
+    verify_call_code(open_file(json_filename, &json), JSONTPL_ERROR_LOAD);
+    verify_call_code(jsontpl_paths_load(tpl->paths, json.data, json.len, root),
+        JSONTPL_ERROR_LOAD);
     
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    autostr_free(&name);                                                    \
-    json_decref(name_context);                                              \
-    autostr_free(&variable_name);                                           \
-    json_decref(variable_obj);                                              \
+    free(paths);                                                            \
+    jsontpl_paths_free(&shared);                                            \
 } while (0)
-/**
- * Read a name from the template (which includes dot-separated identifiers and
- * optionally a filter), then store the object it identifies in `obj` and its
- * full name in `full_name`.
- */
-static int parse_name(
-        cursor_t *c,
-        json_t *context,
-        autostr_t *full_name,
-        json_t **obj)
-{
-    char ch;
-    autostr_t *name = autostr();
-    json_t *name_context = context;
-    autostr_t *variable_name = autostr();
-    json_t *variable_obj = NULL;
-    
-    json_incref(name_context);
-    
-    verify_call(discard_blank(c));
-    
-    while ((ch = cursor_peek(c)) != '\0') {
-        switch (ch) {
-            
-            case '{':
-                /* Curly braces indicate variable names. Sorry for adding those. */
-                cursor_read(c);
-                verify_call(parse_name(c, context, variable_name, &variable_obj));
-                verify_call(discard_blank(c));
-                verify_call(parse_seq(c, "}"));
-                verify(json_is_string(variable_obj), "%s: not a string", variable_name->ptr);
-                autostr_append(name, json_string_value(variable_obj));
-                json_decref(variable_obj);
-                variable_obj = NULL;
-                break;
-            
-            case '.':
-                /* Periods indicate object subscripting.  The name up to the
-                   period must be an object in the context.  That object then
-                   becomes the context. */
-                cursor_read(c);
-                verify(autostr_len(name), "empty name component");
-                verify_call(valid_name(name_context, name, full_name));
-                *obj = json_object_get(name_context, name->ptr);
-                verify(json_is_object(*obj), "%s: not an object", full_name->ptr);
-                autostr_push(full_name, '.');
-                json_incref(*obj);
-                json_decref(name_context);
-                name_context = *obj;
-                autostr_recycle(&name);
-                break;
-            
-            case '|':
-                /* Pipes indicate filters. */
-                cursor_read(c);
-                verify_call(valid_name(name_context, name, full_name));
-                *obj = json_object_get(name_context, name->ptr);
-                json_incref(*obj);
-                verify_call(parse_filter(c, obj));
-                verify_return();
-            
-            default:
-                if (isident(ch)) {
-                    verify_call(parse_identifier(c, name));
-                    autostr_append(full_name, name->ptr);
-                } else {
-                    *obj = json_object_get(name_context, name->ptr);
-                    json_incref(*obj);
-                    verify_return();
-                }
-        }
-        
+int jsontpl_templates_parse_json(
+        jsontpl_template_t **tpls,
+        size_t count,
+        const char *json,
+        size_t len,
+        json_t **root)
+{
+    size_t i;
+    jsontpl_paths_t **paths = malloc((count + 1) * sizeof(jsontpl_paths_t *));
+    jsontpl_paths_t *shared;
+    
+    for (i = 0; i < count; i++) {
+        paths[i] = tpls[i]->paths;
     }
+    shared = jsontpl_paths_union(paths, count);
+    verify_call_code(jsontpl_paths_load(shared, json, len, root),
+        JSONTPL_ERROR_LOAD);
     
-    verify_fail("EOF while reading name");
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup close_file(&json)
+int jsontpl_templates_load_json(
+        jsontpl_template_t **tpls,
+        size_t count,
+        const char *json_filename,
+        json_t **root)
+{
+    file_contents_t json = {NULL, 0, 0};
+    int status;
+    
+    verify_call_code(open_file(json_filename, &json), JSONTPL_ERROR_LOAD);
+    status = jsontpl_templates_parse_json(tpls, count, json.data, json.len, root);
+    verify_call_code(status, status);
+    
+    verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(obj);                                                       \
-    autostr_free(&full_name);                                               \
+    json_decref(root);                                                      \
+    autostr_free(&line);                                                    \
+    output_detach(&out);                                                    \
 } while (0)
-/**
- * Read a value from the template and write it to the output.
- */
-static int parse_value(
-        cursor_t *c,
-        json_t *context,
-        jsontpl_scope scope,
-        output_t *out)
+int jsontpl_template_render_ndjson(
+        jsontpl_template_t *tpl,
+        FILE *input,
+        FILE *output,
+        const char *separator,
+        size_t *records)
 {
-    json_t *obj = NULL;
-    autostr_t *full_name = autostr();
+    size_t line_number = 0, count = 0;
+    char eof;
+    json_t *root = NULL;
+    autostr_t *line = autostr();
+    /* One buffered output for the whole stream, flushed at the end */
+    output_t *out = output_file(output);
     
-    if (scope & SCOPE_DISCARD) {
-        verify_call(discard_until(c, "=}"));
-    } else {
-        verify_call(parse_name(c, context, full_name, &obj));
-        verify_json_not_null(obj, full_name);
-        verify_call(parse_seq(c, "=}"));
-        verify_call(stringify_json(obj, full_name, out));
+    if (records) *records = 0;
+    
+    for (;;) {
+        verify_call_code(read_line(input, line, &eof), JSONTPL_ERROR_LOAD);
+        if (eof) break;
+        line_number++;
+        /* The line ending is just trailing whitespace to the parser */
+        if (strspn(line->ptr, " \t\r\n") == (size_t)autostr_len(line)) continue;
+        
+        verify_call_hint_code(
+            jsontpl_paths_load(tpl->paths, line->ptr, autostr_len(line), &root),
+            JSONTPL_ERROR_LOAD, "record on line %zu", line_number);
+        if (count && separator) output_append(out, separator);
+        verify_call_hint_code(render_output(tpl, root, out),
+            JSONTPL_ERROR_RENDER, "record on line %zu", line_number);
+        json_decref(root);
+        root = NULL;
+        
+        count++;
+        if (records) *records = count;
     }
+    verify_call_code(output_flush(out), JSONTPL_ERROR_RENDER);
     
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(old_value);                                                 \
-    autostr_free(&value);                                                   \
+    output_detach(&out);                                                    \
+    autostr_free(&str);                                                     \
 } while (0)
 /**
- * Read the foreach block's value identifier, then parse the inner template with
- * each value in the array.
+ * Render into a string and hand it over, trimmed to fit if `shrink` is set.
  */
-static int parse_foreach_array(
-        cursor_t *c,
-        json_t *context,
-        json_t *array,
-        output_t *out)
-{
-    cursor_t starting_cursor;
-    json_t *old_value = NULL;
-    autostr_t *value = autostr();
-    // Borrowed references; no need to free during cleanup]
-    size_t array_index;
-    json_t *array_value;
-    
-    verify_call(parse_identifier(c, value));
-    verify_call(parse_seq(c, "%}"));
-    
-    if (json_array_size(array) == 0) {
-        verify_call(parse_template(c, context, SCOPE_DISCARD, out));
-        verify_return();
-    }
+static int render_string(
+        jsontpl_template_t *tpl,
+        json_t *root,
+        char **output,
+        size_t *length,
+        char shrink)
+{
+    autostr_t *str = autostr();
+    output_t *out = output_str(str);
     
-    starting_cursor = *c;
-    old_value = json_object_get(context, value->ptr);
-    json_incref(old_value);
+    verify_call_code(render_output(tpl, root, out), JSONTPL_ERROR_RENDER);
     
-    json_array_foreach(array, array_index, array_value) {
-        json_object_set(context, value->ptr, array_value);
-        *c = starting_cursor;
-        verify_call(parse_template(c, context, SCOPE_FOREACH, out));
-    }
+    /* Hand the rendered string over instead of copying it. */
+    if (length) *length = autostr_len(str);
+    *output = autostr_release(&str, shrink);
     
-    json_object_set(context, value->ptr, old_value);
+    verify_return();
+}
+
+int jsontpl_template_render_string(
+        jsontpl_template_t *tpl,
+        json_t *root,
+        char **output,
+        size_t *length)
+{
+    return render_string(tpl, root, output, length, 1);
+}
+
+#undef verify_cleanup
+#define verify_cleanup output_detach(&out)
+int jsontpl_template_render_file(
+        jsontpl_template_t *tpl,
+        json_t *root,
+        FILE *output)
+{
+    /* Detached rather than freed: the file belongs to the caller. */
+    output_t *out = output_file(output);
+    
+    verify_call_code(render_output(tpl, root, out), JSONTPL_ERROR_RENDER);
+    verify_call_code(output_flush(out), JSONTPL_ERROR_RENDER);
     
     verify_return();
 }
 
+size_t jsontpl_template_size(jsontpl_template_t *tpl)
+{
+    return sizeof(jsontpl_template_t) + tpl->source.len +
+        jsontpl_program_size(tpl->program);
+}
+
+void jsontpl_template_free(jsontpl_template_t **tpl)
+{
+    if (*tpl) {
+        jsontpl_program_free(&(*tpl)->program);
+        jsontpl_paths_free(&(*tpl)->paths);
+        close_file(&(*tpl)->source);
+        free(*tpl);
+        *tpl = NULL;
+    }
+}
+
+int jsontpl_string(char *json, char *template, char **output)
+{
+    return jsontpl_string_len(json, template, output, NULL, 1);
+}
+
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(old_key);                                                   \
-    json_decref(old_value);                                                 \
-    autostr_free(&key);                                                     \
-    autostr_free(&value);                                                   \
+    json_decref(root);                                                      \
+    jsontpl_template_free(&tpl);                                            \
 } while (0)
-/**
- * Read the foreach block's key and value identifiers, then parse the inner
- * template with each key/value pair in the object.
- */
-static int parse_foreach_object(
-        cursor_t *c,
-        json_t *context,
-        json_t *object,
-        output_t *out)
-{
-    cursor_t starting_cursor;
-    json_t *old_key = NULL,
-           *old_value = NULL;
-    autostr_t *key = autostr(),
-            *value = autostr();
-    // Borrowed references; no need to free during cleanup
-    const char *object_key;
-    json_t *object_value;
-    
-    verify_call(parse_identifier(c, key));
-    verify_call(parse_seq(c, "->"));
-    verify_call(parse_identifier(c, value));
-    verify_call(parse_seq(c, "%}"));
-    
-    if (json_object_size(object) == 0) {
-        verify_call(parse_template(c, context, SCOPE_DISCARD, out));
-        verify_return();
-    }
+int jsontpl_string_len(
+        char *json,
+        char *template,
+        char **output,
+        size_t *length,
+        char shrink)
+{
+    int status;
+    json_t *root = NULL;
+    jsontpl_template_t *tpl = NULL;
     
-    starting_cursor = *c;
-    old_key = json_object_get(context, key->ptr);
-    old_value = json_object_get(context, value->ptr);
-    json_incref(old_key);
-    json_incref(old_value);
-    
-    json_object_foreach(object, object_key, object_value) {
-        json_object_set_new(context, key->ptr, json_string(object_key));
-        json_object_set(context, value->ptr, object_value);
-        *c = starting_cursor;
-        verify_call(parse_template(c, context, SCOPE_FOREACH, out));
-    }
+    // Load the whole JSON object, fully validated
+    verify_call_code(jsontpl_paths_load(NULL, json, strlen(json), &root),
+        JSONTPL_ERROR_LOAD);
+    status = jsontpl_template_compile(template, &tpl);
+    verify_call_code(status, status);
     
-    json_object_set(context, key->ptr, old_key);
-    json_object_set(context, value->ptr, old_value);
+    status = render_string(tpl, root, output, length, shrink);
+    verify_call_code(status, status);
     
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(obj);                                                       \
-    autostr_free(&full_name);                                               \
+    close_file(&json);                                                      \
+    json_decref(root);                                                      \
+    jsontpl_template_free(&tpl);                                            \
 } while (0)
+int jsontpl_file(char *json_filename, char *template_filename, FILE *output)
+{
+    int status;
+    file_contents_t json = {NULL, 0, 0};
+    json_t *root = NULL;
+    jsontpl_template_t *tpl = NULL;
+    
+    // Load the whole JSON object, fully validated
+    verify_call_code(open_file(json_filename, &json), JSONTPL_ERROR_LOAD);
+    verify_call_code(jsontpl_paths_load(NULL, json.data, json.len, &root),
+        JSONTPL_ERROR_LOAD);
+    status = jsontpl_template_load(template_filename, &tpl);
+    verify_call_code(status, status);
+    
+    status = jsontpl_template_render_file(tpl, root, output);
+    verify_call_code(status, status);
+    
+    verify_return();
+}
+
+#ifdef JSONTPL_MAIN
+/* Arrays at least this long are rendered in parallel with --threads. */
+#define JSONTPL_MAIN_PARALLEL_MIN 1024
+
 /**
- * Pass control to parse_foreach_array or parse_foreach_object, depending on
- * the type of the given JSON value.
+ * Return a monotonic time in seconds, for reporting throughput.
  */
-static int parse_foreach(
-        cursor_t *c,
-        json_t *context,
-        output_t *out)
-{
-    json_t *obj = NULL;
-    autostr_t *full_name = autostr();
-    
-    verify_call(parse_name(c, context, full_name, &obj));
-    verify_json_not_null(obj, full_name);
-    verify_call(parse_seq(c, ":"));
-    
-    if (json_is_array(obj)) {
-        verify_call(parse_foreach_array(c, context, obj, out));
-    } else if (json_is_object(obj)) {
-        verify_call(parse_foreach_object(c, context, obj, out));
-    } else {
-        verify_fail("foreach block requires an object or array");
-    }
+static double seconds(void)
+{
+#ifndef _WIN32
+    struct timespec ts;
     
-    verify_return();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else // _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif // _WIN32
 }
 
 #undef verify_cleanup
 #define verify_cleanup
+static int open_input(const char *filename, FILE **input)
+{
+    *input = fopen(filename, "rb");
+    verify(*input != NULL, "%s: no such file", filename);
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    if (input && input != stdin) fclose(input);                             \
+    jsontpl_template_free(&tpl);                                            \
+} while (0)
 /**
- * Discard characters until the matching end-block is reached.
+ * Render the template once per record of the NDJSON file (or standard input,
+ * if `ndjson_filename` is NULL or "-"), then report the throughput on stderr.
  */
-static int parse_comment(
-        cursor_t *c,
-        json_t *context,
-        output_t *out)
+static int ndjson_main(
+        jsontpl_pool_t *pool,
+        const char *template_filename,
+        const char *ndjson_filename,
+        const char *separator)
 {
-    verify_call(parse_seq(c, "%}"));
-    verify_call(parse_template(c, context, SCOPE_DISCARD | SCOPE_FORCE_DISCARD, out));
+    int status;
+    size_t records = 0;
+    double start = seconds(), elapsed;
+    FILE *input = stdin;
+    jsontpl_template_t *tpl = NULL;
+    
+    status = jsontpl_template_load(template_filename, &tpl);
+    verify_call_code(status, status);
+    jsontpl_template_set_pool(tpl, pool, JSONTPL_MAIN_PARALLEL_MIN);
+    
+    if (ndjson_filename && strcmp(ndjson_filename, "-") != 0) {
+        verify_call_code(open_input(ndjson_filename, &input), JSONTPL_ERROR_LOAD);
+    }
+    
+    status = jsontpl_template_render_ndjson(tpl, input, stdout, separator, &records);
+    elapsed = seconds() - start;
+    fprintf(stderr, "%zu records in %.3f s (%.0f records/s)\n", records, elapsed,
+        elapsed > 0 ? records / elapsed : 0.0);
+    verify_call_code(status, status);
+    
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(obj);                                                       \
-    autostr_free(&full_name);                                               \
+    json_decref(root);                                                      \
+    jsontpl_template_free(&tpl);                                            \
 } while (0)
 /**
- * Read a name and, if its value exists and is true, nonzero, or non-empty,
- * parse the inner template.
+ * Render the template against the JSON file, loading only the values the
+ * template references, with large foreach blocks rendered on the pool.
  */
-static int parse_if(
-        cursor_t *c,
-        json_t *context,
-        output_t *out)
+static int file_main(
+        jsontpl_pool_t *pool,
+        const char *json_filename,
+        const char *template_filename)
 {
-    char discard = 0;
-    jsontpl_scope scope = SCOPE_IF;
-    json_t *obj = NULL;
-    autostr_t *full_name = autostr();
+    int status;
+    json_t *root = NULL;
+    jsontpl_template_t *tpl = NULL;
     
-    verify_call(parse_name(c, context, full_name, &obj));
-    verify_call(parse_seq(c, "%}"));
+    status = jsontpl_template_load(template_filename, &tpl);
+    verify_call_code(status, status);
+    jsontpl_template_set_pool(tpl, pool, JSONTPL_MAIN_PARALLEL_MIN);
+    status = jsontpl_template_load_json(tpl, json_filename, &root);
+    verify_call_code(status, status);
+    status = jsontpl_template_render_file(tpl, root, stdout);
+    verify_call_code(status, status);
     
-    if (obj == NULL) {
-        discard = 1;
+    verify_return();
+}
+
+/**
+ * One page of a batch: the template, JSON input and output paths point into
+ * `paths`, which holds the three strings one after another.
+ */
+typedef struct {
+    char *paths;
+    const char *template_filename;
+    const char *json_filename;
+    const char *output_filename;
+    size_t template;
+    int status;
+    double latency;
+} batch_job_t;
+
+/**
+ * A batch of pages.  Each distinct template file is compiled once into
+ * `templates`, numbered by `names`, and `template_status` holds the result of
+ * loading it.  If `root` is set, every page renders against it instead of
+ * loading its own JSON input.
+ */
+typedef struct {
+    jsontpl_pool_t *pool;
+    json_t *names;
+    json_t *root;
+    size_t jobs_len;
+    size_t jobs_size;
+    batch_job_t *jobs;
+    size_t templates_len;
+    const char **template_filenames;
+    jsontpl_template_t **templates;
+    int *template_status;
+} batch_t;
+
+static void batch_free(batch_t *batch)
+{
+    size_t i;
     
-    } else {
-        switch (json_typeof(obj)) {
-            
-            case JSON_NULL:
-            case JSON_FALSE:
-                discard = 1;
-                break;
-            
-            case JSON_TRUE:
-                break;
-            
-            case JSON_REAL:
-                discard = !json_real_value(obj);
-                break;
-            
-            case JSON_INTEGER:
-                discard = !json_integer_value(obj);
-                break;
-            
-            case JSON_STRING:
-                discard = !json_string_value(obj)[0];
-                break;
-            
-            case JSON_ARRAY:
-                discard = !json_array_size(obj);
-                break;
-            
-            case JSON_OBJECT:
-                discard = !json_object_size(obj);
-                break;
-            
-            default:
-                verify_fail("internal error: unknown JSON type");
-        }
+    for (i = 0; i < batch->jobs_len; i++) {
+        free(batch->jobs[i].paths);
+    }
+    for (i = 0; i < batch->templates_len; i++) {
+        jsontpl_template_free(&batch->templates[i]);
     }
+    free(batch->jobs);
+    free(batch->template_filenames);
+    free(batch->templates);
+    free(batch->template_status);
+    json_decref(batch->names);
+    json_decref(batch->root);
+}
+
+/**
+ * Add a page to the batch, numbering its template file if it's new.
+ */
+static void batch_add(
+        batch_t *batch,
+        const char *template_filename,
+        const char *json_filename,
+        const char *output_filename)
+{
+    size_t template_len = strlen(template_filename) + 1;
+    size_t json_len = strlen(json_filename) + 1;
+    size_t output_len = strlen(output_filename) + 1;
+    json_t *index;
+    batch_job_t *job;
     
-    if (discard) scope |= SCOPE_DISCARD;
+    if (batch->jobs_len == batch->jobs_size) {
+        batch->jobs_size = batch->jobs_size ? batch->jobs_size * 2 : 64;
+        batch->jobs = realloc(batch->jobs, batch->jobs_size * sizeof(batch_job_t));
+    }
+    job = &batch->jobs[batch->jobs_len++];
+    memset(job, 0, sizeof(batch_job_t));
     
-    verify_call(parse_template(c, context, scope, out));
+    job->paths = malloc(template_len + json_len + output_len);
+    job->template_filename = memcpy(job->paths, template_filename, template_len);
+    job->json_filename = memcpy(job->paths + template_len, json_filename, json_len);
+    job->output_filename = memcpy(job->paths + template_len + json_len,
+        output_filename, output_len);
     
-    verify_return();
+    if (batch->names == NULL) batch->names = json_object();
+    index = json_object_get(batch->names, template_filename);
+    if (index) {
+        job->template = (size_t)json_integer_value(index);
+    } else {
+        job->template = batch->templates_len++;
+        json_object_set_new(batch->names, template_filename,
+            json_integer((json_int_t)job->template));
+        batch->template_filenames = realloc(batch->template_filenames,
+            batch->templates_len * sizeof(const char *));
+        batch->template_filenames[job->template] = job->template_filename;
+    }
 }
 
 #undef verify_cleanup
-#define verify_cleanup autostr_free(&block_type)
+#define verify_cleanup autostr_free(&line)
 /**
- * Read the block type.  If it's an end-block, `end` is set to 1 and control is
- * returned to parse_template.  If it's an else-block, the rest of the if-block
- * is parsed or discarded accordingly.  Other block types are passed along to
- * the corresponding function.
+ * Read the manifest: one page per line, giving the template, JSON input and
+ * output paths separated by tabs.  Blank lines and lines starting with '#' are
+ * skipped.
  */
-static int parse_block(
-        cursor_t *c,
-        json_t *context,
-        jsontpl_scope scope,
-        output_t *out,
-        char *end)
-{
-    *end = 0;
-    jsontpl_scope inner_scope;
-    size_t line = cursor_line(c),
-           column = cursor_column(c);
-    autostr_t *block_type = autostr();
-    
-    verify_call(parse_identifier(c, block_type));
-    
-    if (strcmp(block_type->ptr, "end") == 0) {
-        verify_call(parse_seq(c, "%}"));
-        *end = 1;
-    
-    } else if (strcmp(block_type->ptr, "else") == 0) {
-        if (scope & SCOPE_FORCE_DISCARD) {
-            /* Ignore nested if-else block when discarding input. */
-            verify_call(discard_until(c, "%}"));
-        } else if (scope & SCOPE_IF) {
-            inner_scope = SCOPE_ELSE;
-            if (!(scope & SCOPE_DISCARD)) {
-                inner_scope |= SCOPE_DISCARD;
-            }
-            verify_call(parse_seq(c, "%}"));
-            verify_call(parse_template(c, context, inner_scope, out));
-            /* Unlike other blocks, else 'steals' the scope from its enclosing
-               if block; when it ends, the if block ends as well. */
-            *end = 1;
-        } else {
-            verify_fail("unexpected else marker");
-        }
+static int batch_read(batch_t *batch, FILE *input)
+{
+    char eof, *fields[3], *end;
+    size_t line_number = 0, field;
+    autostr_t *line = autostr();
     
-    } else if (scope & SCOPE_DISCARD) {
-        verify_call(discard_until(c, "%}"));
-        inner_scope = SCOPE_DISCARD;
-        if (strcmp(block_type->ptr, "if") == 0) {
-            /* Normally an else block is allowed to switch the scope from a
-               discarding one to non-discarding and vice-versa, but if the
-               scope in which the if/else block appears is already discarding,
-               the entire block should be silenced. */
-            inner_scope |= SCOPE_FORCE_DISCARD;
-        }
-        verify_call(parse_template(c, context, inner_scope, out));
-            
-    } else if (strcmp(block_type->ptr, "foreach") == 0) {
-        verify_call_hint(parse_foreach(c, context, out),
-            JSONTPL_BLOCK_HINT, "foreach", line, column);
+    for (;;) {
+        verify_call(read_line(input, line, &eof));
+        if (eof) break;
+        line_number++;
         
-    } else if (strcmp(block_type->ptr, "if") == 0) {
-        verify_call_hint(parse_if(c, context, out),
-            JSONTPL_BLOCK_HINT, "if", line, column);
+        if (strspn(line->ptr, " \t\r\n") == (size_t)autostr_len(line)) continue;
+        if (line->ptr[0] == '#') continue;
         
-    } else if (strcmp(block_type->ptr, "comment") == 0) {
-        verify_call_hint(parse_comment(c, context, out),
-            JSONTPL_BLOCK_HINT, "comment", line, column);
-        
-    } else {
-        verify_fail("unknown block type '%s'", block_type->ptr);
+        // Split the line at its tabs and drop the line ending
+        line->ptr[strcspn(line->ptr, "\r\n")] = '\0';
+        fields[0] = line->ptr;
+        for (field = 1; field < 3 && (end = strchr(fields[field - 1], '\t')); field++) {
+            *end = '\0';
+            fields[field] = end + 1;
+        }
+        verify(field == 3 && !strchr(fields[2], '\t') && *fields[0] && *fields[1] && *fields[2],
+            "manifest line %zu: expected template, JSON and output paths "
+            "separated by tabs", line_number);
+        batch_add(batch, fields[0], fields[1], fields[2]);
     }
     
     verify_return();
 }
 
-#undef verify_cleanup
-#define verify_cleanup output_set_write(out, write_old)
-static int parse_template(
-        cursor_t *c,
-        json_t *context,
-        jsontpl_scope scope,
-        output_t *out)
+/* Pool task: compile one of the batch's templates. */
+static int batch_compile(void *arg, size_t index)
 {
-    char ch, end;
-    char write_old = output_get_write(out);
+    batch_t *batch = arg;
     
-    output_set_write(out, !(scope & SCOPE_DISCARD));
+    batch->template_status[index] = jsontpl_template_load(
+        batch->template_filenames[index], &batch->templates[index]);
+    if (batch->template_status[index] == 0) {
+        jsontpl_template_set_pool(batch->templates[index], batch->pool,
+            JSONTPL_MAIN_PARALLEL_MIN);
+    }
+    return 0;
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    if (output) fclose(output);                                             \
+    json_decref(root);                                                      \
+} while (0)
+static int batch_render_job(
+        batch_t *batch,
+        jsontpl_template_t *tpl,
+        batch_job_t *job)
+{
+    int status;
+    json_t *root = NULL;
+    FILE *output = NULL;
     
-    while ((ch = cursor_read(c)) != '\0') {
-        /* Useful for debugging:
-           verify_log_("%c", ch); */
-        
-        switch (ch) {
-            
-            case '{':
-                /* Curly braces indicate a value or a block. */
-                switch (cursor_peek(c)) {
-                    
-                    case '=':
-                        cursor_read(c);
-                        verify_call(parse_value(c, context, scope, out));
-                        break;
-                    
-                    case '%':
-                        cursor_read(c);
-                        verify_call(parse_block(c, context, scope, out, &end));
-                        if (end) {
-                            verify(scope != SCOPE_FILE, "unmatched block terminator");
-                            verify_return();
-                        }
-                        break;
-                    
-                    default:
-                        output_push(out, ch);
-                }
-                break;
-            
-            case '\\':
-                /* When a backslash precedes a curly brace or another
-                   backslash, print that character literally and skip this
-                   backslash.  Otherwise, print this backslash literally. */
-                switch (cursor_peek(c)) {                        
-                    case '{':
-                    case '}':
-                    case '\\':
-                        output_push(out, cursor_read(c));
-                        break;
-                    default:
-                        output_push(out, ch);
-                }
-                break;
-            
-            default:
-                /* Write all other characters to the output buffer. */
-                output_push(out, ch);
-        }
+    if (batch->root == NULL) {
+        status = jsontpl_template_load_json(tpl, job->json_filename, &root);
+        verify_call_code(status, status);
     }
+    output = fopen(job->output_filename, "wb");
+    verify_call_code(output == NULL, JSONTPL_ERROR_LOAD);
+    status = jsontpl_template_render_file(tpl, root ? root : batch->root, output);
+    verify_call_code(status, status);
     
-    verify(scope == SCOPE_FILE, "unexpected EOF");
     verify_return();
 }
 
-#undef verify_cleanup
-#define verify_cleanup
+/* Pool task: render one page, recording its status and latency.  A failed
+   page doesn't stop the others. */
+static int batch_render(void *arg, size_t index)
+{
+    batch_t *batch = arg;
+    batch_job_t *job = &batch->jobs[index];
+    double start = seconds();
+    
+    job->status = batch->template_status[job->template];
+    if (job->status == 0) {
+        job->status = batch_render_job(batch, batch->templates[job->template], job);
+    }
+    if (job->status) {
+        fprintf(stderr, "%s: rendering %s with %s failed\n", job->output_filename,
+            job->json_filename, job->template_filename);
+    }
+    job->latency = seconds() - start;
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
 /**
- * Common function used to verify whether a JSON object was successfully read.
+ * Print the batch's throughput and its distribution of per-page latencies on
+ * stderr.
  */
-static int valid_root(json_t *root, json_error_t error)
+static void batch_report(batch_t *batch, double elapsed)
 {
-    verify(root != NULL, JSONTPL_JSON_ERROR, error.text, error.line, error.column);
-    verify(json_is_object(root), "root is not an object");
-    verify_return();
+    size_t i, failed = 0, n = batch->jobs_len;
+    double *latencies = malloc((n + 1) * sizeof(double));
+    
+    for (i = 0; i < n; i++) {
+        latencies[i] = batch->jobs[i].latency * 1000;
+        if (batch->jobs[i].status) failed++;
+    }
+    qsort(latencies, n, sizeof(double), compare_double);
+    
+    fprintf(stderr, "%zu pages (%zu failed) from %zu templates in %.3f s "
+        "(%.0f pages/s) on %zu threads\n", n, failed, batch->templates_len,
+        elapsed, elapsed > 0 ? n / elapsed : 0.0, jsontpl_pool_size(batch->pool));
+    if (n) {
+        fprintf(stderr, "latency ms: min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, "
+            "max %.3f\n", latencies[0], latencies[(n - 1) / 2],
+            latencies[(n - 1) * 9 / 10], latencies[(n - 1) * 99 / 100],
+            latencies[n - 1]);
+    }
+    
+    free(latencies);
 }
 
 #undef verify_cleanup
-#define verify_cleanup free(c)
-static int jsontpl_jansson(json_t *root, char *template, output_t *out)
+#define verify_cleanup free(loaded)
+/**
+ * Compile the batch's templates and render its pages, handing them out to the
+ * pool's threads as they become free, so slow pages don't hold up the rest.
+ * If `shared_json_filename` isn't NULL, it's parsed once, after the templates
+ * are compiled, keeping only what one of them can reference, and every page
+ * renders against it.  Then report on the batch, counting from `start`, and
+ * return the status of the first failed page.
+ */
+static int batch_run(batch_t *batch, const char *shared_json_filename, double start)
 {
-    cursor_t *c = cursor(template);
+    size_t i, loaded_len = 0;
+    int status;
+    jsontpl_template_t **loaded = NULL;
+    
+    batch->templates = calloc(batch->templates_len + 1, sizeof(jsontpl_template_t *));
+    batch->template_status = calloc(batch->templates_len + 1, sizeof(int));
+    jsontpl_pool_run(batch->pool, batch->templates_len, batch_compile, batch);
+    
+    if (shared_json_filename) {
+        loaded = malloc((batch->templates_len + 1) * sizeof(jsontpl_template_t *));
+        for (i = 0; i < batch->templates_len; i++) {
+            if (batch->templates[i]) loaded[loaded_len++] = batch->templates[i];
+        }
+        status = jsontpl_templates_load_json(loaded, loaded_len,
+            shared_json_filename, &batch->root);
+        verify_call_code(status, status);
+    }
     
-    verify_call_hint(parse_template(c, root, SCOPE_FILE, out),
-        "reached line %d, column %d", cursor_line(c), cursor_column(c));
+    jsontpl_pool_run(batch->pool, batch->jobs_len, batch_render, batch);
+    batch_report(batch, seconds() - start);
+    
+    for (i = 0; i < batch->jobs_len; i++) {
+        verify_call_code(batch->jobs[i].status, batch->jobs[i].status);
+    }
     
     verify_return();
 }
 
-
-/* Public functions: */
-
-
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    json_decref(root);                                                      \
-    output_free(&out);                                                      \
+    if (input && input != stdin) fclose(input);                             \
+    batch_free(&batch);                                                     \
 } while (0)
-    
-int jsontpl_string(char *json, char *template, char **output)
+/**
+ * Render every page of the manifest (or standard input, if
+ * `manifest_filename` is "-").
+ */
+static int batch_main(jsontpl_pool_t *pool, const char *manifest_filename)
 {
-    json_error_t error;
-    json_t *root = NULL;
-    output_t *out = NULL;
+    int status;
+    double start = seconds();
+    FILE *input = stdin;
+    batch_t batch;
     
-    // Load JSON object from string
-    root = json_loads(json, JSON_REJECT_DUPLICATES, &error);
-    verify_call(valid_root(root, error)); 
+    memset(&batch, 0, sizeof(batch_t));
+    batch.pool = pool;
     
-    out = output_str(autostr());
-    verify_call(jsontpl_jansson(root, template, out));
-    *output = malloc(autostr_len(output_get_str(out)) + 1);
-    strcpy(*output, autostr_value(output_get_str(out)));
+    if (strcmp(manifest_filename, "-") != 0) {
+        verify_call_code(open_input(manifest_filename, &input), JSONTPL_ERROR_LOAD);
+    }
+    verify_call_code(batch_read(&batch, input), JSONTPL_ERROR_LOAD);
+    status = batch_run(&batch, NULL, start);
+    verify_call_code(status, status);
     
     verify_return();
 }
 
+static int compare_string(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
 #undef verify_cleanup
 #define verify_cleanup do {                                                 \
-    if (template_file) fclose(template_file);                               \
-    free(template);                                                         \
-    json_decref(root);                                                      \
-    output_free(&out);                                                      \
+    for (i = 0; i < names_len; i++) free(names[i]);                         \
+    free(names);                                                            \
+    autostr_free(&template_filename);                                       \
+    autostr_free(&output_filename);                                         \
+    if (dir) closedir(dir);                                                 \
+    batch_free(&batch);                                                     \
 } while (0)
-int jsontpl_file(char *json_filename, char *template_filename, FILE *outfile)
+/**
+ * Render every template in `template_dir` against the one JSON file, parsed
+ * once for all of them, into a file of the same name in `output_dir`, less
+ * any ".tpl" extension.  Hidden files and anything that isn't a regular file
+ * are skipped.
+ */
+static int site_main(
+        jsontpl_pool_t *pool,
+        const char *json_filename,
+        const char *template_dir,
+        const char *output_dir)
 {
-    json_error_t error;
-    long filesize_ftell;
-    size_t filesize_fread;
-    char *template = NULL;
-    json_t *root = NULL;
-    FILE *template_file = NULL;
-    output_t *out = NULL;
-    
-    // Load JSON object from file
-    root = json_load_file(json_filename, JSON_REJECT_DUPLICATES, &error);
-    verify_call(valid_root(root, error));
+    int status;
+    size_t i, names_len = 0, names_size = 0, len;
+    double start = seconds();
+    char **names = NULL;
+    autostr_t *template_filename = autostr();
+    autostr_t *output_filename = autostr();
+    batch_t batch;
+#ifndef _WIN32
+    DIR *dir = NULL;
+    struct dirent *entry;
+    struct stat st;
+#else // _WIN32
+    void *dir = NULL;
+#endif // _WIN32
     
-    // Open template file
-    template_file = fopen(template_filename, "rb");
-    verify(template_file != NULL, "%s: no such file", template_filename);
-    
-    // Get file size
-    fseek(template_file, 0, SEEK_END);
-    filesize_ftell = ftell(template_file);
-    verify_bare(filesize_ftell != -1L);
-    rewind(template_file);
+    memset(&batch, 0, sizeof(batch_t));
+    batch.pool = pool;
     
-    // Read template into memory
-    template = malloc(filesize_ftell + 1);
-    template[filesize_ftell] = '\0';
-    filesize_fread = fread(template, 1, filesize_ftell, template_file);
-    verify_bare(filesize_ftell == filesize_fread);
+#ifndef _WIN32
+    dir = opendir(template_dir);
+    verify_call_hint_code(dir == NULL, JSONTPL_ERROR_LOAD,
+        "%s: can't open directory", template_dir);
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        autostr_append(autostr_append(autostr_clear(template_filename),
+            template_dir), "/");
+        autostr_append(template_filename, entry->d_name);
+        if (stat(autostr_value(template_filename), &st) != 0 ||
+                !S_ISREG(st.st_mode)) continue;
+        
+        if (names_len == names_size) {
+            names_size = names_size ? names_size * 2 : 64;
+            names = realloc(names, names_size * sizeof(char *));
+        }
+        names[names_len] = malloc(strlen(entry->d_name) + 1);
+        strcpy(names[names_len++], entry->d_name);
+    }
+#else // _WIN32
+    verify_fail("--site isn't supported on Windows");
+#endif // _WIN32
     
-    out = output_file(outfile);
+    // Sort the pages, so they're numbered the same way on every run
+    qsort(names, names_len, sizeof(char *), compare_string);
+    for (i = 0; i < names_len; i++) {
+        autostr_append(autostr_append(autostr_clear(template_filename),
+            template_dir), "/");
+        autostr_append(template_filename, names[i]);
+        
+        len = strlen(names[i]);
+        if (len > 4 && strcmp(names[i] + len - 4, ".tpl") == 0) len -= 4;
+        autostr_append(autostr_append(autostr_clear(output_filename),
+            output_dir), "/");
+        autostr_append_len(output_filename, names[i], len);
+        
+        batch_add(&batch, autostr_value(template_filename), json_filename,
+            autostr_value(output_filename));
+    }
     
-    verify_call(jsontpl_jansson(root, template, out));
+    status = batch_run(&batch, json_filename, start);
+    verify_call_code(status, status);
     
     verify_return();
 }
 
-#ifdef JSONTPL_MAIN
 /**
- * Main function for jsontpl.  Expects exactly three command-line arguments:
- * a JSON file path, a template file path, and an output file path.  Any parse
+ * Return the number of processors online, to size the pool for --batch,
+ * --site and --serve.
+ */
+static long processors(void)
+{
+#ifndef _WIN32
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#else // _WIN32
+    return 1;
+#endif // _WIN32
+}
+
+/**
+ * Main function for jsontpl.  Expects either a JSON file path and a template
+ * file path, or "--ndjson" followed by a template file path and optionally an
+ * NDJSON file path (standard input by default) and a separator to write
+ * between records (a newline by default), or "--batch" followed by a manifest
+ * of pages to render (see batch_read), or "--site" followed by a JSON file
+ * path, a directory of templates and an output directory (see site_main), or
+ * "--serve" followed by a socket path and a directory of templates (see
+ * jsontpl_serve), optionally after "--cache-bytes N" to bound its cache.
+ * "--threads N" before any form renders foreach blocks over large arrays on N
+ * threads; batches and sites also render their pages on those threads, and
+ * servers serve that many connections at once, one per processor by default.
+ * Output goes to stdout, or to the pages' files in a batch or site; any parse
  * errors are reported on stderr.  Return code is 0 on success, 1 on invalid
- * argument count, or the last line number on which an error was reported.
+ * arguments, or one of the JSONTPL_ERROR_* codes.
  */
 int main(int argc, char *argv[])
 {
+    int arg = 1, status, positional;
+    char ndjson = 0, batch = 0, site = 0, serve = 0, usage = 0;
+    long threads = 0;
+    unsigned long cache_bytes = 0;
+    jsontpl_pool_t *pool = NULL;
+    
+    // Read options
+    for (; arg < argc && !usage && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--ndjson") == 0) {
+            ndjson = 1;
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[arg], "--site") == 0) {
+            site = 1;
+        } else if (strcmp(argv[arg], "--serve") == 0) {
+            serve = 1;
+        } else if (strcmp(argv[arg], "--cache-bytes") == 0 && arg + 1 < argc) {
+            cache_bytes = strtoul(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            threads = strtol(argv[++arg], NULL, 10);
+            usage = threads < 1;
+        } else {
+            usage = 1;
+        }
+    }
+    positional = argc - arg;
+    
     // Check arg count
-    if (argc != 3) {
+    if (ndjson + batch + site + serve > 1 || (cache_bytes && !serve)) {
+        usage = 1;
+    } else if (ndjson) {
+        usage = positional < 1 || positional > 3;
+    } else if (batch) {
+        usage = positional != 1;
+    } else if (site) {
+        usage = positional != 3;
+    } else if (serve) {
+        usage = positional != 2;
+    } else {
+        usage = positional != 2;
+    }
+    if (usage) {
         char *progname = "jsontpl";
         if (argc) progname = argv[0];
-        fprintf(stderr, "USAGE: %s json-file template-file", progname);
+        fprintf(stderr, "USAGE: %s [--threads N] json-file template-file\n"
+            "       %s [--threads N] --ndjson template-file [ndjson-file [separator]]\n"
+            "       %s [--threads N] --batch manifest-file\n"
+            "       %s [--threads N] --site json-file template-dir output-dir\n"
+            "       %s [--threads N] [--cache-bytes N] --serve socket-path template-dir\n",
+            progname, progname, progname, progname, progname);
         return 1;
     }
     
@@ -741,6 +1132,27 @@ int main(int argc, char *argv[])
     _setmode(1,_O_BINARY);
     #endif // _WIN32
     
-    return jsontpl_file(argv[1], argv[2], stdout);
+    if ((batch || site || serve) && threads == 0) {
+        threads = processors();
+    }
+    if (threads > 1) {
+        pool = jsontpl_pool_new(threads);
+    }
+    
+    if (batch) {
+        status = batch_main(pool, argv[arg]);
+    } else if (serve) {
+        status = jsontpl_serve(pool, argv[arg], argv[arg + 1], cache_bytes);
+    } else if (site) {
+        status = site_main(pool, argv[arg], argv[arg + 1], argv[arg + 2]);
+    } else if (ndjson) {
+        status = ndjson_main(pool, argv[arg], positional > 1 ? argv[arg + 1] : NULL,
+            positional > 2 ? argv[arg + 2] : "\n");
+    } else {
+        status = file_main(pool, argv[arg], argv[arg + 1]);
+    }
+    
+    jsontpl_pool_free(&pool);
+    return status;
 }
 #endif
\ No newline at end of file
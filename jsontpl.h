@@ -2,16 +2,371 @@
 #define JSONTPL_H
 
 #include <stdio.h>
+#include <jansson.h>
+
+/**
+ * Status codes returned by the public functions.  Each phase of the work has
+ * its own code, so callers can tell which one failed; the details are
+ * reported on stderr.
+ */
+typedef enum {
+    JSONTPL_OK = 0,
+    // Reading or decoding the JSON input or the template file failed.
+    JSONTPL_ERROR_LOAD = 2,
+    // The template has a syntax error.
+    JSONTPL_ERROR_COMPILE = 3,
+    // The template doesn't fit the JSON input (e.g. a missing name).
+    JSONTPL_ERROR_RENDER = 4,
+    // A custom filter was rejected by jsontpl_env_add_filter.
+    JSONTPL_ERROR_FILTER = 5,
+} jsontpl_status;
+
+/**
+ * A set of custom filters.  Templates compiled with an environment can use
+ * its filters as well as the built-in ones, which they shadow.  Register all
+ * the filters before compiling templates with the environment, and free it
+ * only after the templates.
+ */
+typedef struct jsontpl_env jsontpl_env_t;
+
+/**
+ * The output that a template is being rendered to.
+ */
+typedef struct output jsontpl_output_t;
+
+/**
+ * Custom filters declare the JSON types they accept as a mask of these bits,
+ * e.g. JSONTPL_FILTER_TYPE(JSON_STRING) | JSONTPL_FILTER_TYPE(JSON_INTEGER).
+ * Values of any other type are a render error.
+ */
+#define JSONTPL_FILTER_TYPE(type) (1u << (type))
+#define JSONTPL_FILTER_ANY_TYPE (~0u)
+
+/**
+ * A custom filter that produces a value.  `value` points to a borrowed
+ * reference to the input; replace it with a new reference to the result.
+ * Return 0 on success or nonzero to fail the render.
+ */
+typedef int (*jsontpl_filter_func_t)(json_t **value);
+
+/**
+ * A custom filter that writes its result straight to the output with
+ * jsontpl_output_write, without making a JSON value for it.  `value` is
+ * borrowed.  Return 0 on success or nonzero to fail the render.
+ */
+typedef int (*jsontpl_filter_write_t)(json_t *value, jsontpl_output_t *output);
+
+/**
+ * A compiled template.  Compile it once, then render it against any number of
+ * JSON objects.
+ *
+ * Rendering only reads the template and the JSON input; neither the values nor
+ * their reference counts are modified.  Any number of threads can render the
+ * same or different templates against the same root at once without locking,
+ * as long as nothing modifies or frees them meanwhile.
+ */
+typedef struct jsontpl_template jsontpl_template_t;
+
+/**
+ * A pool of worker threads that templates can share for rendering large
+ * foreach blocks in parallel.
+ */
+typedef struct jsontpl_pool jsontpl_pool_t;
+
+/**
+ * A cache of compiled template files for long-running programs.  A file is
+ * compiled the first time it's requested and again whenever its modification
+ * time or size changes, and the new version replaces the old one atomically.
+ * Any number of threads can use the cache at once; requests for files that
+ * are already compiled take no locks.
+ */
+typedef struct jsontpl_cache jsontpl_cache_t;
+
+/**
+ * A template checked out of a cache.  Its template stays valid until it is
+ * released, even if the file changes and the cache compiles it again.
+ */
+typedef struct jsontpl_cached jsontpl_cached_t;
+
+/**
+ * Counters of how a cache's requests were served.
+ */
+typedef struct {
+    // Requests for a file that was compiled and hadn't changed
+    unsigned long hits;
+    // Requests for a file that hadn't been compiled yet
+    unsigned long misses;
+    // Requests for a file that had changed since it was compiled
+    unsigned long reloads;
+    // Versions dropped to keep the cache within its budget
+    unsigned long evictions;
+    // Roughly how much memory the current versions take up
+    size_t bytes;
+} jsontpl_cache_stats_t;
+
+/**
+ * Return a newly allocated environment with no custom filters.
+ */
+jsontpl_env_t *jsontpl_env_new(void);
+
+/**
+ * Register a custom filter.  `name` must be an identifier that isn't already
+ * registered in the environment, `types` must accept at least one type, and at
+ * least one of `func` and `write` must be given.  `func` is used where the
+ * filtered value is needed (in blocks and variable names) and `write` where it
+ * is written out; either one stands in for the other when it's NULL.
+ */
+int jsontpl_env_add_filter(
+        jsontpl_env_t *env,
+        const char *name,
+        unsigned types,
+        jsontpl_filter_func_t func,
+        jsontpl_filter_write_t write);
+
+/**
+ * Deallocate the environment and set the pointer to NULL.
+ */
+void jsontpl_env_free(jsontpl_env_t **env);
+
+/**
+ * Write `len` bytes of `str` to the output.  For use by custom filters.
+ */
+void jsontpl_output_write(jsontpl_output_t *output, const char *str, size_t len);
+
+/**
+ * Return a newly allocated pool that runs work on `threads` threads in total,
+ * counting the thread that hands it the work, so a pool of 1 thread runs
+ * everything on the caller.  Where threads aren't supported, every pool is a
+ * pool of 1.
+ */
+jsontpl_pool_t *jsontpl_pool_new(size_t threads);
+
+/**
+ * Stop the pool's threads, deallocate it and set the pointer to NULL.  No
+ * template may be rendering with it.
+ */
+void jsontpl_pool_free(jsontpl_pool_t **pool);
+
+/**
+ * Compile a template string and assign `tpl` to a newly allocated template.
+ */
+int jsontpl_template_compile(const char *template, jsontpl_template_t **tpl);
+
+/**
+ * Compile a template string that may use the environment's custom filters.
+ */
+int jsontpl_template_compile_env(
+        const jsontpl_env_t *env,
+        const char *template,
+        jsontpl_template_t **tpl);
+
+/**
+ * Read and compile a template file and assign `tpl` to a newly allocated
+ * template.  Where possible the file is mapped into memory and parsed in place
+ * rather than copied; it stays mapped until the template is freed, so it must
+ * not be truncated in the meantime.
+ */
+int jsontpl_template_load(const char *template_filename, jsontpl_template_t **tpl);
+
+/**
+ * Read and compile a template file that may use the environment's custom
+ * filters.
+ */
+int jsontpl_template_load_env(
+        const jsontpl_env_t *env,
+        const char *template_filename,
+        jsontpl_template_t **tpl);
+
+/**
+ * Read and compile a template file like jsontpl_template_load_env, but from a
+ * private copy of the file instead of a mapping of it, so the template isn't
+ * affected if the file is rewritten while it's in use.
+ */
+int jsontpl_template_read_env(
+        const jsontpl_env_t *env,
+        const char *template_filename,
+        jsontpl_template_t **tpl);
+
+/**
+ * Render foreach blocks over arrays of at least `min_items` items on the
+ * pool's threads (or never, if `pool` is NULL).  The array is split into
+ * chunks that are rendered into separate buffers and written out in order,
+ * so the output is the same as a serial render, byte for byte.  Blocks nested
+ * inside a parallel block are rendered serially by its threads.  This must
+ * only be enabled if the environment's custom filters can run on several
+ * threads at once, and only be changed while nothing is rendering the
+ * template.  The pool must outlive its use by the template.
+ */
+void jsontpl_template_set_pool(
+        jsontpl_template_t *tpl,
+        jsontpl_pool_t *pool,
+        size_t min_items);
+
+/**
+ * Parse `len` bytes of JSON text into `root`, which must be an object, for
+ * rendering with the template.  Only the values that the template can
+ * reference are kept.  The rest of the text is only checked for balanced
+ * structure and well-formed tokens: invalid UTF-8 and duplicate keys in it go
+ * unnoticed, unlike jsontpl_string and jsontpl_file, which load and validate
+ * the whole input.  Templates whose names start with a variable component,
+ * such as `{key}.name`, need the whole input.
+ */
+int jsontpl_template_parse_json(
+        jsontpl_template_t *tpl,
+        const char *json,
+        size_t len,
+        json_t **root);
+
+/**
+ * Read a JSON file and parse it for the template, as with
+ * jsontpl_template_parse_json.
+ */
+int jsontpl_template_load_json(
+        jsontpl_template_t *tpl,
+        const char *json_filename,
+        json_t **root);
+
+/**
+ * Parse JSON text once for rendering with any of the `count` templates, as
+ * with jsontpl_template_parse_json, keeping the values that at least one of
+ * them can reference.  Rendering never modifies `root`, so it can be shared
+ * by renders running at the same time.
+ */
+int jsontpl_templates_parse_json(
+        jsontpl_template_t **tpls,
+        size_t count,
+        const char *json,
+        size_t len,
+        json_t **root);
+
+/**
+ * Read a JSON file and parse it for the templates, as with
+ * jsontpl_templates_parse_json.
+ */
+int jsontpl_templates_load_json(
+        jsontpl_template_t **tpls,
+        size_t count,
+        const char *json_filename,
+        json_t **root);
+
+/**
+ * Render the template against the JSON object `root` and assign `output` to a
+ * newly allocated string pointer, which the caller must free.  If `length` is
+ * not NULL, it is set to the length of the string.
+ */
+int jsontpl_template_render_string(
+        jsontpl_template_t *tpl,
+        json_t *root,
+        char **output,
+        size_t *length);
+
+/**
+ * Render the template against the JSON object `root` and write the result to
+ * `output`, which is left open.
+ */
+int jsontpl_template_render_file(
+        jsontpl_template_t *tpl,
+        json_t *root,
+        FILE *output);
+
+/**
+ * Render the template once for every record of newline-delimited JSON read
+ * from `input`, writing `separator` (if not NULL) between the results.  Each
+ * record must be an object on a line of its own; blank lines are skipped.
+ * Records are parsed as with jsontpl_template_parse_json and released once
+ * rendered, so memory use is bounded by the largest record.  If `records` is
+ * not NULL, it is set to the number of records rendered, including when a
+ * record fails; the output of the records before it has been written by then.
+ */
+int jsontpl_template_render_ndjson(
+        jsontpl_template_t *tpl,
+        FILE *input,
+        FILE *output,
+        const char *separator,
+        size_t *records);
+
+/**
+ * Return roughly how many bytes of memory the template takes up, including
+ * its source.
+ */
+size_t jsontpl_template_size(jsontpl_template_t *tpl);
+
+/**
+ * Deallocate the template and set the pointer to NULL.
+ */
+void jsontpl_template_free(jsontpl_template_t **tpl);
+
+/**
+ * Return a newly allocated, empty cache whose templates are compiled with the
+ * environment's custom filters (or only the built-in ones, if `env` is NULL).
+ */
+jsontpl_cache_t *jsontpl_cache_new(const jsontpl_env_t *env);
+
+/**
+ * Limit the memory that the cache's templates take up, as measured by
+ * jsontpl_template_size, to `bytes`, or remove the limit if it's 0 (the
+ * default).  When a new version takes the cache over its budget, the least
+ * recently used files are dropped until it's within it again, though the
+ * file just requested is always kept.  Dropped files are compiled again when
+ * next requested; templates checked out of them stay valid until released.
+ */
+void jsontpl_cache_set_budget(jsontpl_cache_t *cache, size_t bytes);
+
+/**
+ * Check out the template file from the cache, compiling it if it's new or
+ * has changed since it was compiled, and assign it to `cached`.  Release it
+ * with jsontpl_cache_release when done rendering.
+ */
+int jsontpl_cache_get(
+        jsontpl_cache_t *cache,
+        const char *template_filename,
+        jsontpl_cached_t **cached);
+
+/**
+ * Return the checked-out template.
+ */
+jsontpl_template_t *jsontpl_cached_template(jsontpl_cached_t *cached);
+
+/**
+ * Release a template checked out with jsontpl_cache_get and set the pointer
+ * to NULL.  Versions that have been replaced or dropped are freed once their
+ * last user releases them.
+ */
+void jsontpl_cache_release(jsontpl_cache_t *cache, jsontpl_cached_t **cached);
+
+/**
+ * Copy the cache's counters into `stats`.
+ */
+void jsontpl_cache_stats(jsontpl_cache_t *cache, jsontpl_cache_stats_t *stats);
+
+/**
+ * Deallocate the cache and its templates and set the pointer to NULL.  Every
+ * checked-out template must have been released.
+ */
+void jsontpl_cache_free(jsontpl_cache_t **cache);
 
 /**
  * Parse a JSON string and template string and assign `output` to a newly
- * allocated string pointer.
+ * allocated string pointer.  The whole JSON input is loaded and validated.
  */
 int jsontpl_string(char *json, char *template, char **output);
 
 /**
- * Parse a JSON file and template file and assign `output` to a newly allocated
- * string pointer.
+ * As jsontpl_string, but also set `length` to the length of the output, if
+ * it isn't NULL.  The output is the string the template was rendered into;
+ * unless `shrink` is nonzero, it keeps whatever spare room it grew, which
+ * saves a reallocation for callers that free it soon.
+ */
+int jsontpl_string_len(
+        char *json,
+        char *template,
+        char **output,
+        size_t *length,
+        char shrink);
+
+/**
+ * Parse a JSON file and template file and write the result to `output`.  The
+ * whole JSON input is loaded and validated.
  */
 int jsontpl_file(char *json_filename, char *template_filename, FILE *output);
 
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsontpl_arena.h"
+
+/* Return the aligned offset at which `size` bytes fit in the chunk after the
+   first `used` bytes, or (size_t)-1 if they don't. */
+static size_t chunk_fit(jsontpl_arena_chunk_t *chunk, size_t used, size_t size)
+{
+    size_t pad = (JSONTPL_ARENA_ALIGN -
+        ((uintptr_t)(chunk->data + used) & (JSONTPL_ARENA_ALIGN - 1))) &
+        (JSONTPL_ARENA_ALIGN - 1);
+
+    if (chunk->size - used < pad || chunk->size - used - pad < size) {
+        return (size_t)-1;
+    }
+    return used + pad;
+}
+
+
+/* Public functions: */
+
+
+void jsontpl_arena_init(jsontpl_arena_t *arena, void *buffer, size_t size)
+{
+    arena->first.next = NULL;
+    arena->first.size = size;
+    arena->first.data = buffer;
+    arena->chunk = &arena->first;
+    arena->used = 0;
+}
+
+void *jsontpl_arena_alloc(jsontpl_arena_t *arena, size_t size)
+{
+    size_t start, chunk_size;
+    jsontpl_arena_chunk_t *next;
+
+    if (size == 0) size = 1;
+
+    for (;;) {
+        start = chunk_fit(arena->chunk, arena->used, size);
+        if (start != (size_t)-1) {
+            arena->used = start + size;
+            return arena->chunk->data + start;
+        }
+
+        /* Move on to the next chunk, which is kept from before the last
+           reset, or insert a new one if it's missing or too small. */
+        next = arena->chunk->next;
+        if (next == NULL || next->size < size + JSONTPL_ARENA_ALIGN) {
+            chunk_size = size + JSONTPL_ARENA_ALIGN;
+            if (chunk_size < JSONTPL_ARENA_CHUNK) chunk_size = JSONTPL_ARENA_CHUNK;
+            next = malloc(sizeof(jsontpl_arena_chunk_t) + chunk_size);
+            next->next = arena->chunk->next;
+            next->size = chunk_size;
+            next->data = (char *)(next + 1);
+            arena->chunk->next = next;
+        }
+        arena->chunk = next;
+        arena->used = 0;
+    }
+}
+
+void *jsontpl_arena_grow(
+        jsontpl_arena_t *arena,
+        void *ptr,
+        size_t old_size,
+        size_t new_size)
+{
+    char *start = ptr;
+    char *result;
+    jsontpl_arena_chunk_t *chunk = arena->chunk;
+
+    if (start && start + old_size == chunk->data + arena->used &&
+            (size_t)(start - chunk->data) + new_size <= chunk->size) {
+        arena->used = (start - chunk->data) + new_size;
+        return ptr;
+    }
+
+    result = jsontpl_arena_alloc(arena, new_size);
+    if (start) memcpy(result, start, old_size);
+    return result;
+}
+
+jsontpl_arena_mark_t jsontpl_arena_mark(jsontpl_arena_t *arena)
+{
+    jsontpl_arena_mark_t mark;
+
+    mark.chunk = arena->chunk;
+    mark.used = arena->used;
+    return mark;
+}
+
+void jsontpl_arena_reset(jsontpl_arena_t *arena, jsontpl_arena_mark_t mark)
+{
+    arena->chunk = mark.chunk;
+    arena->used = mark.used;
+}
+
+void jsontpl_arena_free(jsontpl_arena_t *arena)
+{
+    jsontpl_arena_chunk_t *chunk = arena->first.next, *next;
+
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first.next = NULL;
+    arena->chunk = &arena->first;
+    arena->used = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef JSONTPL_ARENA_H
+#define JSONTPL_ARENA_H
+
+#include <stdlib.h>
+
+/**
+ * Size of each chunk the arena allocates once its initial buffer is full,
+ * unless a single allocation needs more.
+ */
+#define JSONTPL_ARENA_CHUNK 4096
+
+/**
+ * Allocations are aligned to this many bytes.
+ */
+#define JSONTPL_ARENA_ALIGN 16
+
+typedef struct jsontpl_arena_chunk {
+    struct jsontpl_arena_chunk *next;
+    size_t size;
+    char *data;
+} jsontpl_arena_chunk_t;
+
+/**
+ * A bump allocator for short-lived memory.  It starts out in a buffer that
+ * the caller provides (normally on the stack) and chains heap chunks after it
+ * as needed.  Memory is never freed piecemeal: jsontpl_arena_reset releases
+ * everything allocated since a mark, keeping the chunks for reuse, and
+ * jsontpl_arena_free releases the chunks.  All fields are private, and the
+ * arena must not be moved once initialized.
+ */
+typedef struct {
+    jsontpl_arena_chunk_t first;
+    jsontpl_arena_chunk_t *chunk;
+    size_t used;
+} jsontpl_arena_t;
+
+/**
+ * A position in the arena to reset to.
+ */
+typedef struct {
+    jsontpl_arena_chunk_t *chunk;
+    size_t used;
+} jsontpl_arena_mark_t;
+
+/**
+ * Initialize the arena with the `size` bytes of `buffer`, which must outlive
+ * it.  `buffer` may be NULL if `size` is 0.
+ */
+void jsontpl_arena_init(jsontpl_arena_t *arena, void *buffer, size_t size);
+
+/**
+ * Return `size` bytes of uninitialized, aligned memory.
+ */
+void *jsontpl_arena_alloc(jsontpl_arena_t *arena, size_t size);
+
+/**
+ * Resize an allocation from `old_size` to `new_size` bytes, preserving its
+ * contents.  The most recent allocation grows in place if there's room;
+ * otherwise the contents are copied to a new allocation and the old space is
+ * only reclaimed when the arena is reset.
+ */
+void *jsontpl_arena_grow(
+        jsontpl_arena_t *arena,
+        void *ptr,
+        size_t old_size,
+        size_t new_size);
+
+/**
+ * Return the current position, for a later jsontpl_arena_reset.
+ */
+jsontpl_arena_mark_t jsontpl_arena_mark(jsontpl_arena_t *arena);
+
+/**
+ * Release everything allocated since the mark was taken.
+ */
+void jsontpl_arena_reset(jsontpl_arena_t *arena, jsontpl_arena_mark_t mark);
+
+/**
+ * Free the chunks allocated on the heap.  The arena can't be used afterwards
+ * unless it's initialized again.
+ */
+void jsontpl_arena_free(jsontpl_arena_t *arena);
+
+#endif // JSONTPL_ARENA_H
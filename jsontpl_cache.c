@@ -0,0 +1,398 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif // _WIN32
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif // _WIN32
+
+#include "jsontpl.h"
+#include "jsontpl_cache.h"
+#include "verify.h"
+
+/**
+ * What a file looked like when it was compiled.  A file whose stamp differs
+ * is compiled again.
+ */
+typedef struct {
+    long long mtime_sec;
+    long mtime_nsec;
+    long long size;
+} file_stamp_t;
+
+/**
+ * One compiled version of a file, which never changes once it's published.
+ * `refs` counts the cache's own reference, while this is the file's current
+ * version, and one per checkout; the last one to drop its reference frees it.
+ */
+struct jsontpl_cached {
+    jsontpl_template_t *tpl;
+    file_stamp_t stamp;
+    size_t size;
+    size_t refs;
+};
+
+/**
+ * A file the cache has compiled.  Entries are only added to the front of
+ * their bucket's list and never removed while the cache exists, so readers
+ * can walk the lists without locking.  An evicted file's entry stays, with no
+ * current version.
+ */
+typedef struct jsontpl_cache_entry {
+    char *filename;
+    jsontpl_cached_t *current;
+    // The cache's clock when the entry was last used, for eviction
+    unsigned long last_used;
+    struct jsontpl_cache_entry *next;
+} jsontpl_cache_entry_t;
+
+/**
+ * Lookups take no locks.  A reader announces itself in `readers` for the
+ * current `epoch` only while it loads an entry's current version and takes a
+ * reference to it.  A writer that unpublishes a version waits until the
+ * readers of both epochs have drained before dropping the cache's reference,
+ * so no reader can take a reference to a version that's been freed.  Writers
+ * take the lock, so compiling one file never blocks lookups of another.
+ */
+struct jsontpl_cache {
+    const jsontpl_env_t *env;
+    size_t budget;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif // _WIN32
+    size_t readers[2];
+    unsigned epoch;
+    unsigned long clock;
+    jsontpl_cache_stats_t stats;
+    jsontpl_cache_entry_t *buckets[JSONTPL_CACHE_BUCKETS];
+};
+
+/* Without pthreads, a cache may only be used by one thread. */
+#ifndef _WIN32
+#define cache_lock(cache) pthread_mutex_lock(&(cache)->lock)
+#define cache_unlock(cache) pthread_mutex_unlock(&(cache)->lock)
+#define cache_yield() sched_yield()
+#else // _WIN32
+#define cache_lock(cache)
+#define cache_unlock(cache)
+#define cache_yield()
+#endif // _WIN32
+
+/* Fields shared between threads are only accessed through these. */
+#define atomic_get(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define atomic_set(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define atomic_swap(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define atomic_inc(ptr) __atomic_add_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(ptr) __atomic_sub_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+#define atomic_add(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_SEQ_CST)
+#define atomic_sub(ptr, value) __atomic_sub_fetch((ptr), (value), __ATOMIC_SEQ_CST)
+
+#undef verify_cleanup
+#define verify_cleanup
+static int file_stamp(const char *filename, file_stamp_t *stamp)
+{
+    struct stat st;
+
+    verify(stat(filename, &st) == 0, "%s: no such file", filename);
+    stamp->mtime_sec = st.st_mtime;
+#ifndef _WIN32
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+#else // _WIN32
+    stamp->mtime_nsec = 0;
+#endif // _WIN32
+    stamp->size = st.st_size;
+
+    verify_return();
+}
+
+static int stamp_equal(const file_stamp_t *a, const file_stamp_t *b)
+{
+    return a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+        a->size == b->size;
+}
+
+static int stamp_newer(const file_stamp_t *a, const file_stamp_t *b)
+{
+    return a->mtime_sec > b->mtime_sec ||
+        (a->mtime_sec == b->mtime_sec && a->mtime_nsec > b->mtime_nsec);
+}
+
+/* FNV-1a */
+static size_t filename_bucket(const char *filename)
+{
+    size_t hash = 2166136261u;
+
+    for (; *filename; filename++) {
+        hash = (hash ^ (unsigned char)*filename) * 16777619u;
+    }
+    return hash % JSONTPL_CACHE_BUCKETS;
+}
+
+/* Return the file's entry, or NULL if it has none. */
+static jsontpl_cache_entry_t *cache_find(jsontpl_cache_t *cache, const char *filename)
+{
+    jsontpl_cache_entry_t *entry;
+
+    entry = atomic_get(&cache->buckets[filename_bucket(filename)]);
+    for (; entry; entry = entry->next) {
+        if (strcmp(entry->filename, filename) == 0) return entry;
+    }
+    return NULL;
+}
+
+/* Add an entry with no current version for the file.  The cache must be
+   locked, and the file mustn't have an entry. */
+static jsontpl_cache_entry_t *cache_insert(jsontpl_cache_t *cache, const char *filename)
+{
+    jsontpl_cache_entry_t **bucket = &cache->buckets[filename_bucket(filename)];
+    jsontpl_cache_entry_t *entry = calloc(1, sizeof(jsontpl_cache_entry_t));
+
+    entry->filename = malloc(strlen(filename) + 1);
+    strcpy(entry->filename, filename);
+    entry->next = *bucket;
+    /* Readers see the entry only once it's complete */
+    atomic_set(bucket, entry);
+    return entry;
+}
+
+/* Check out the entry's current version if it has the stamp, or return
+   NULL. */
+static jsontpl_cached_t *cache_checkout(
+        jsontpl_cache_t *cache,
+        jsontpl_cache_entry_t *entry,
+        const file_stamp_t *stamp)
+{
+    unsigned epoch = atomic_get(&cache->epoch) & 1;
+    jsontpl_cached_t *cached;
+
+    atomic_inc(&cache->readers[epoch]);
+    cached = atomic_get(&entry->current);
+    if (cached && stamp_equal(&cached->stamp, stamp)) {
+        atomic_inc(&cached->refs);
+    } else {
+        cached = NULL;
+    }
+    atomic_dec(&cache->readers[epoch]);
+
+    if (cached) atomic_set(&entry->last_used, atomic_inc(&cache->clock));
+    return cached;
+}
+
+/* Wait until every reader that could have loaded a version unpublished
+   before the call has taken its reference.  Readers of the current epoch are
+   waited for too, since a reader may read the epoch just before it flips.
+   The cache must be locked. */
+static void cache_synchronize(jsontpl_cache_t *cache)
+{
+    int round;
+    unsigned old;
+
+    for (round = 0; round < 2; round++) {
+        old = atomic_get(&cache->epoch) & 1;
+        atomic_set(&cache->epoch, old ^ 1);
+        while (atomic_get(&cache->readers[old])) cache_yield();
+    }
+}
+
+/* Drop a reference to the version, freeing it if it was the last. */
+static void cached_unref(jsontpl_cached_t *cached)
+{
+    if (atomic_dec(&cached->refs) == 0) {
+        jsontpl_template_free(&cached->tpl);
+        free(cached);
+    }
+}
+
+/* Drop the cache's references to versions that have been unpublished, once
+   no reader can be about to take a reference to them.  The cache must be
+   locked. */
+static void cache_retire(jsontpl_cache_t *cache, jsontpl_cached_t **retired, size_t count)
+{
+    size_t i;
+
+    if (count == 0) return;
+    cache_synchronize(cache);
+    for (i = 0; i < count; i++) {
+        cached_unref(retired[i]);
+    }
+}
+
+/* Unpublish the least recently used versions, other than `keep`'s, until the
+   cache is within its budget.  The cache must be locked. */
+static void cache_evict(jsontpl_cache_t *cache, jsontpl_cache_entry_t *keep)
+{
+    size_t i, count = 0;
+    jsontpl_cache_entry_t *entry, *victim;
+    jsontpl_cached_t **retired = NULL;
+
+    while (cache->budget && cache->stats.bytes > cache->budget) {
+        victim = NULL;
+        for (i = 0; i < JSONTPL_CACHE_BUCKETS; i++) {
+            for (entry = cache->buckets[i]; entry; entry = entry->next) {
+                if (entry == keep || entry->current == NULL) continue;
+                if (victim == NULL ||
+                        atomic_get(&entry->last_used) < atomic_get(&victim->last_used)) {
+                    victim = entry;
+                }
+            }
+        }
+        if (victim == NULL) break;
+
+        retired = realloc(retired, (count + 1) * sizeof(jsontpl_cached_t *));
+        retired[count] = atomic_swap(&victim->current, NULL);
+        atomic_sub(&cache->stats.bytes, retired[count]->size);
+        atomic_inc(&cache->stats.evictions);
+        count++;
+    }
+
+    cache_retire(cache, retired, count);
+    free(retired);
+}
+
+
+/* Public functions: */
+
+
+jsontpl_cache_t *jsontpl_cache_new(const jsontpl_env_t *env)
+{
+    jsontpl_cache_t *cache = calloc(1, sizeof(jsontpl_cache_t));
+
+    cache->env = env;
+#ifndef _WIN32
+    pthread_mutex_init(&cache->lock, NULL);
+#endif // _WIN32
+    return cache;
+}
+
+void jsontpl_cache_set_budget(jsontpl_cache_t *cache, size_t bytes)
+{
+    cache_lock(cache);
+    cache->budget = bytes;
+    cache_evict(cache, NULL);
+    cache_unlock(cache);
+}
+
+#undef verify_cleanup
+#define verify_cleanup jsontpl_template_free(&tpl)
+int jsontpl_cache_get(
+        jsontpl_cache_t *cache,
+        const char *template_filename,
+        jsontpl_cached_t **cached)
+{
+    int status;
+    file_stamp_t stamp;
+    jsontpl_cache_entry_t *entry;
+    jsontpl_cached_t *old;
+    jsontpl_template_t *tpl = NULL;
+
+    verify_call_code(file_stamp(template_filename, &stamp), JSONTPL_ERROR_LOAD);
+
+    entry = cache_find(cache, template_filename);
+    *cached = entry ? cache_checkout(cache, entry, &stamp) : NULL;
+    if (*cached) {
+        atomic_inc(&cache->stats.hits);
+        verify_return();
+    }
+
+    /* Compile without holding the lock, so other files are still compiled.
+       A file changed during compilation is caught by the next request, since
+       the stamp was taken first.  The file is copied rather than mapped, as
+       old versions stay in use while it's rewritten. */
+    status = jsontpl_template_read_env(cache->env, template_filename, &tpl);
+    verify_call_code(status, status);
+
+    cache_lock(cache);
+    entry = cache_find(cache, template_filename);
+    if (entry == NULL) entry = cache_insert(cache, template_filename);
+
+    *cached = cache_checkout(cache, entry, &stamp);
+    if (*cached) {
+        /* Somebody else compiled this version in the meantime */
+        atomic_inc(&cache->stats.hits);
+        cache_unlock(cache);
+        verify_return();
+    }
+
+    *cached = calloc(1, sizeof(jsontpl_cached_t));
+    (*cached)->tpl = tpl;
+    (*cached)->stamp = stamp;
+    (*cached)->size = jsontpl_template_size(tpl);
+    (*cached)->refs = 1;
+    tpl = NULL;
+
+    old = entry->current;
+    if (old) {
+        atomic_inc(&cache->stats.reloads);
+    } else {
+        atomic_inc(&cache->stats.misses);
+    }
+
+    /* Unless a newer version got there first, swap this one in.  Renders of
+       the old version carry on; it's freed when the last of them is done. */
+    if (old == NULL || !stamp_newer(&old->stamp, &stamp)) {
+        (*cached)->refs++;
+        atomic_add(&cache->stats.bytes, (*cached)->size);
+        atomic_set(&entry->current, *cached);
+        atomic_set(&entry->last_used, atomic_inc(&cache->clock));
+        if (old) {
+            atomic_sub(&cache->stats.bytes, old->size);
+            cache_retire(cache, &old, 1);
+        }
+        cache_evict(cache, entry);
+    }
+    cache_unlock(cache);
+
+    verify_return();
+}
+
+jsontpl_template_t *jsontpl_cached_template(jsontpl_cached_t *cached)
+{
+    return cached->tpl;
+}
+
+void jsontpl_cache_release(jsontpl_cache_t *cache, jsontpl_cached_t **cached)
+{
+    /* Entries carry their own reference count; the cache argument is kept so
+       that release mirrors jsontpl_cache_get */
+    (void)cache;
+    if (*cached) {
+        cached_unref(*cached);
+        *cached = NULL;
+    }
+}
+
+void jsontpl_cache_stats(jsontpl_cache_t *cache, jsontpl_cache_stats_t *stats)
+{
+    stats->hits = atomic_get(&cache->stats.hits);
+    stats->misses = atomic_get(&cache->stats.misses);
+    stats->reloads = atomic_get(&cache->stats.reloads);
+    stats->evictions = atomic_get(&cache->stats.evictions);
+    stats->bytes = atomic_get(&cache->stats.bytes);
+}
+
+void jsontpl_cache_free(jsontpl_cache_t **cache)
+{
+    size_t i;
+    jsontpl_cache_entry_t *entry, *next;
+
+    if (*cache) {
+        for (i = 0; i < JSONTPL_CACHE_BUCKETS; i++) {
+            for (entry = (*cache)->buckets[i]; entry; entry = next) {
+                next = entry->next;
+                if (entry->current) cached_unref(entry->current);
+                free(entry->filename);
+                free(entry);
+            }
+        }
+#ifndef _WIN32
+        pthread_mutex_destroy(&(*cache)->lock);
+#endif // _WIN32
+        free(*cache);
+        *cache = NULL;
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef JSONTPL_CACHE_H
+#define JSONTPL_CACHE_H
+
+#include "jsontpl.h"
+
+/**
+ * Number of hash buckets that a cache's files are spread over.
+ */
+#define JSONTPL_CACHE_BUCKETS 256
+
+#endif // JSONTPL_CACHE_H
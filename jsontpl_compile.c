@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autostr.h"
+#include "cursor.h"
+#include "jsontpl_compile.h"
+#include "jsontpl_scan.h"
+#include "jsontpl_util.h"
+#include "verify.h"
+
+/**
+ * Compile the template up to EOF (for SCOPE_FILE) or the end-block of the
+ * enclosing block, whose instruction is at index `block_op`.  Literal text
+ * becomes OP_TEXT instructions pointing into the template; values and blocks
+ * are passed to compile_value and compile_block, respectively.
+ */
+static int compile_template(
+        cursor_t *c,
+        jsontpl_program_t *p,
+        jsontpl_scope scope,
+        size_t block_op);
+
+/**
+ * Skip the template up to the end-block of the enclosing block without
+ * compiling anything.  Used for comment blocks, whose contents only need to be
+ * well-formed enough to find the matching end-block.
+ */
+static int skip_template(cursor_t *c, char allow_else);
+
+static jsontpl_name_t *name_new(void)
+{
+    jsontpl_name_t *name = calloc(1, sizeof(jsontpl_name_t));
+    name->full_name = autostr();
+    return name;
+}
+
+static void name_free(jsontpl_name_t **name)
+{
+    size_t i, j;
+    jsontpl_component_t *component;
+
+    if (*name) {
+        for (i = 0; i < (*name)->count; i++) {
+            component = &(*name)->components[i];
+            for (j = 0; j < component->count; j++) {
+                autostr_free(&component->parts[j].identifier);
+                name_free(&component->parts[j].variable);
+            }
+            free(component->parts);
+        }
+        free((*name)->components);
+        jsontpl_chain_free(&(*name)->filters);
+        autostr_free(&(*name)->full_name);
+        free(*name);
+        *name = NULL;
+    }
+}
+
+static size_t str_size(const autostr_t *str)
+{
+    return str ? sizeof(autostr_t) + str->size : 0;
+}
+
+static size_t name_size(const jsontpl_name_t *name)
+{
+    size_t i, j, size;
+    const jsontpl_component_t *component;
+
+    if (name == NULL) return 0;
+
+    size = sizeof(jsontpl_name_t) + str_size(name->full_name) +
+        name->count * sizeof(jsontpl_component_t);
+    for (i = 0; i < name->count; i++) {
+        component = &name->components[i];
+        size += component->count * sizeof(jsontpl_part_t);
+        for (j = 0; j < component->count; j++) {
+            size += str_size(component->parts[j].identifier);
+            size += name_size(component->parts[j].variable);
+        }
+    }
+    for (i = 0; i < name->filters.count; i++) {
+        size += sizeof(jsontpl_stage_t) + (name->filters.stages[i].map ? 256 : 0);
+    }
+    return size;
+}
+
+static jsontpl_component_t *name_push_component(jsontpl_name_t *name)
+{
+    jsontpl_component_t *component;
+
+    name->components = realloc(name->components,
+        (name->count + 1) * sizeof(jsontpl_component_t));
+    component = &name->components[name->count++];
+    component->count = 0;
+    component->parts = NULL;
+
+    return component;
+}
+
+static jsontpl_part_t *component_push_part(jsontpl_component_t *component)
+{
+    jsontpl_part_t *part;
+
+    component->parts = realloc(component->parts,
+        (component->count + 1) * sizeof(jsontpl_part_t));
+    part = &component->parts[component->count++];
+    part->identifier = NULL;
+    part->variable = NULL;
+
+    return part;
+}
+
+/* Append a blank instruction to the program and return its index. */
+static size_t program_push(jsontpl_program_t *p, jsontpl_opcode code, cursor_t *c)
+{
+    jsontpl_op_t *op;
+
+    if (p->len == p->size) {
+        p->size = p->size ? p->size * 2 : 16;
+        p->ops = realloc(p->ops, p->size * sizeof(jsontpl_op_t));
+    }
+    op = &p->ops[p->len];
+    memset(op, 0, sizeof(jsontpl_op_t));
+    op->code = code;
+    op->offset = cursor_offset(c);
+
+    return p->len++;
+}
+
+/* Append a span of literal text to the program.  Spans that directly follow
+   the previous OP_TEXT in the source are merged into it. */
+static void program_push_text(
+        jsontpl_program_t *p,
+        cursor_t *c,
+        const char *text,
+        size_t text_len)
+{
+    size_t index;
+    jsontpl_op_t *op = p->len ? &p->ops[p->len - 1] : NULL;
+
+    if (op && op->code == OP_TEXT && op->text + op->text_len == text) {
+        op->text_len += text_len;
+    } else {
+        index = program_push(p, OP_TEXT, c);
+        op = &p->ops[index];
+        op->text = text;
+        op->text_len = text_len;
+    }
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Discard spaces and tabs and set the cursor to the first non-blank character.
+ */
+static int discard_blank(cursor_t *c)
+{
+    char ch;
+
+    while ((ch = cursor_peek(c)) != '\0') {
+        if (isblank(ch)) {
+            cursor_read(c);
+        } else {
+            verify_return();
+        }
+    }
+
+    /* EOF is certainly an error here, but let the caller decide on the error
+       message, because "EOF encountered while discarding whitespace" wouldn't
+       be terribly helpful. */
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Discard characters until the sequence is found and set the cursor to the
+ * first character following the sequence.
+ */
+static int discard_until(cursor_t *c, const char *seq)
+{
+    size_t seq_len = strlen(seq);
+    const char *start = cursor_pointer(c),
+               *end = start + cursor_remaining(c),
+               *found = start;
+
+    /* The template may not be NUL-terminated, so strstr won't do. */
+    while ((found = memchr(found, seq[0], end - found)) != NULL) {
+        if ((size_t)(end - found) < seq_len) {
+            found = NULL;
+            break;
+        }
+        if (memcmp(found, seq, seq_len) == 0) {
+            break;
+        }
+        found++;
+    }
+
+    verify(found != NULL, "expected '%s', got EOF", seq);
+    cursor_move(c, (found - start) + seq_len);
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Read a sequence from the template, or raise an error if something other than
+ * the given sequence is read.
+ */
+static int parse_seq(cursor_t *c, const char *seq)
+{
+    char ch;
+    size_t seq_index = 0;
+
+    verify_call(discard_blank(c));
+
+    while ((ch = cursor_read(c)) != '\0') {
+
+        verify(ch == seq[seq_index], "expected '%s', got '%c'", seq, ch);
+        seq_index++;
+
+        if (seq[seq_index] == '\0') {
+            verify_return();
+        }
+    }
+
+    verify_fail("expected '%s', got EOF", seq);
+}
+
+#undef verify_cleanup
+#define verify_cleanup autostr_trim(identifier)
+/**
+ * Read an identifier (containing alphanumeric characters and underscores) from
+ * the template and store it in `identifier`, or raise an error if the first
+ * (non-blank) character is not an identifier character.
+ */
+static int parse_identifier(
+        cursor_t *c,
+        autostr_t *identifier)
+{
+    char ch;
+    char seen_ident = 0;
+
+    verify_call(discard_blank(c));
+
+    while ((ch = cursor_peek(c)) != '\0') {
+
+        if (isident(ch)) {
+            seen_ident = 1;
+            autostr_push(identifier, cursor_read(c));
+        } else {
+            verify(seen_ident, "expected an identifier, got '%c'", ch);
+            verify_call(discard_blank(c));
+            verify_return();
+        }
+    }
+
+    verify_fail("EOF while reading identifier");
+}
+
+#undef verify_cleanup
+#define verify_cleanup autostr_free(&filter)
+/**
+ * Read a name from the template (which includes dot-separated components and
+ * optionally a chain of filters) and store it in `name`.  Filters are looked
+ * up in the program's environment.
+ */
+static int compile_name(
+        cursor_t *c,
+        jsontpl_program_t *p,
+        jsontpl_name_t *name)
+{
+    char ch;
+    jsontpl_component_t *component = name_push_component(name);
+    jsontpl_part_t *part;
+    autostr_t *filter = NULL;
+    const jsontpl_filter_t *found;
+
+    verify_call(discard_blank(c));
+
+    while ((ch = cursor_peek(c)) != '\0') {
+        switch (ch) {
+
+            case '{':
+                /* Curly braces indicate variable names. Sorry for adding those. */
+                cursor_read(c);
+                part = component_push_part(component);
+                part->variable = name_new();
+                verify_call(compile_name(c, p, part->variable));
+                verify_call(parse_seq(c, "}"));
+                autostr_push(name->full_name, '{');
+                autostr_append(name->full_name, part->variable->full_name->ptr);
+                autostr_push(name->full_name, '}');
+                break;
+
+            case '.':
+                /* Periods indicate object subscripting.  The component up to
+                   the period must name an object when the template is
+                   rendered. */
+                cursor_read(c);
+                verify(component->count, "empty name component");
+                autostr_push(name->full_name, '.');
+                component = name_push_component(name);
+                break;
+
+            case '|':
+                /* Pipes indicate filters, which are applied from left to
+                   right.  Nothing else can follow them. */
+                verify(component->count, "empty name");
+                while (cursor_peek(c) == '|') {
+                    cursor_read(c);
+                    verify_call(parse_identifier(c, autostr_recycle(&filter)));
+                    found = jsontpl_filter_find(p->env, autostr_value(filter));
+                    verify(found, "unknown filter '%s'", autostr_value(filter));
+                    verify_call(jsontpl_chain_push(&name->filters, found));
+                }
+                verify_return();
+
+            default:
+                if (isident(ch)) {
+                    part = component_push_part(component);
+                    part->identifier = autostr();
+                    verify_call(parse_identifier(c, part->identifier));
+                    autostr_append(name->full_name, part->identifier->ptr);
+                } else {
+                    verify_return();
+                }
+        }
+    }
+
+    verify_fail("EOF while reading name");
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Read a value from the template and compile it to an OP_VALUE instruction.
+ */
+static int compile_value(cursor_t *c, jsontpl_program_t *p)
+{
+    size_t op = program_push(p, OP_VALUE, c);
+
+    p->ops[op].name = name_new();
+    verify_call(compile_name(c, p, p->ops[op].name));
+    verify_call(parse_seq(c, "=}"));
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Read the foreach block's name and its value identifier or key and value
+ * identifiers, then compile the inner template.  Whether the name refers to
+ * an array or an object is only known when the template is rendered.
+ */
+static int compile_foreach(cursor_t *c, jsontpl_program_t *p)
+{
+    size_t op = program_push(p, OP_FOREACH, c);
+    autostr_t *identifier = autostr();
+
+    p->ops[op].name = name_new();
+    p->ops[op].value = identifier;
+    verify_call(compile_name(c, p, p->ops[op].name));
+    verify_call(parse_seq(c, ":"));
+    verify_call(parse_identifier(c, identifier));
+
+    if (cursor_peek(c) == '-') {
+        verify_call(parse_seq(c, "->"));
+        p->ops[op].key = identifier;
+        p->ops[op].value = autostr();
+        verify_call(parse_identifier(c, p->ops[op].value));
+    }
+
+    verify_call(parse_seq(c, "%}"));
+    verify_call(compile_template(c, p, SCOPE_FOREACH, op));
+    p->ops[op].else_op = p->ops[op].end_op = p->len;
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Read the if block's name, then compile the inner template along with its
+ * else-block, if any.
+ */
+static int compile_if(cursor_t *c, jsontpl_program_t *p)
+{
+    size_t op = program_push(p, OP_IF, c);
+
+    p->ops[op].name = name_new();
+    verify_call(compile_name(c, p, p->ops[op].name));
+    verify_call(parse_seq(c, "%}"));
+    verify_call(compile_template(c, p, SCOPE_IF, op));
+
+    p->ops[op].end_op = p->len;
+    if (p->ops[op].else_op == 0) {
+        p->ops[op].else_op = p->len;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip characters until the matching end-block is reached.
+ */
+static int compile_comment(cursor_t *c)
+{
+    verify_call(parse_seq(c, "%}"));
+    verify_call(skip_template(c, 1));
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup autostr_free(&block_type)
+/**
+ * Read the block type.  If it's an end-block, `end` is set to 1 and control is
+ * returned to compile_template.  If it's an else-block, the rest of the
+ * if-block is compiled as its else branch.  Other block types are passed along
+ * to the corresponding function.
+ */
+static int compile_block(
+        cursor_t *c,
+        jsontpl_program_t *p,
+        jsontpl_scope scope,
+        size_t block_op,
+        char *end)
+{
+    size_t op = p->len,
+           offset = cursor_offset(c);
+    autostr_t *block_type = autostr();
+
+    *end = 0;
+
+    verify_call(parse_identifier(c, block_type));
+
+    if (strcmp(block_type->ptr, "end") == 0) {
+        verify_call(parse_seq(c, "%}"));
+        *end = 1;
+
+    } else if (strcmp(block_type->ptr, "else") == 0) {
+        verify(scope & SCOPE_IF, "unexpected else marker");
+        verify_call(parse_seq(c, "%}"));
+        p->ops[block_op].else_op = p->len;
+        verify_call(compile_template(c, p, SCOPE_ELSE, block_op));
+        /* Unlike other blocks, else 'steals' the scope from its enclosing
+           if block; when it ends, the if block ends as well. */
+        *end = 1;
+
+    } else if (strcmp(block_type->ptr, "foreach") == 0) {
+        verify_call_hint(compile_foreach(c, p),
+            JSONTPL_BLOCK_HINT, "foreach",
+            cursor_line_at(c->buffer, offset), cursor_column_at(c->buffer, offset));
+
+    } else if (strcmp(block_type->ptr, "if") == 0) {
+        verify_call_hint(compile_if(c, p),
+            JSONTPL_BLOCK_HINT, "if",
+            cursor_line_at(c->buffer, offset), cursor_column_at(c->buffer, offset));
+
+    } else if (strcmp(block_type->ptr, "comment") == 0) {
+        verify_call_hint(compile_comment(c),
+            JSONTPL_BLOCK_HINT, "comment",
+            cursor_line_at(c->buffer, offset), cursor_column_at(c->buffer, offset));
+
+    } else {
+        verify_fail("unknown block type '%s'", block_type->ptr);
+    }
+
+    /* Report errors at the start of the block rather than after its name.
+       Only a block's own instruction is moved; after an else, `op` is the
+       first instruction of the else body, which keeps its own position. */
+    if (!*end && op < p->len) {
+        p->ops[op].offset = offset;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+static int compile_template(
+        cursor_t *c,
+        jsontpl_program_t *p,
+        jsontpl_scope scope,
+        size_t block_op)
+{
+    char ch, end;
+    size_t span;
+
+    while (cursor_peek(c) != '\0') {
+
+        /* Runs of literal text are emitted as a single span. */
+        span = jsontpl_scan_literal(cursor_pointer(c), cursor_remaining(c));
+        if (span) {
+            program_push_text(p, c, cursor_pointer(c), span);
+            cursor_move(c, span);
+            continue;
+        }
+
+        switch (ch = cursor_read(c)) {
+
+            case '{':
+                /* Curly braces indicate a value or a block. */
+                switch (cursor_peek(c)) {
+
+                    case '=':
+                        cursor_read(c);
+                        verify_call(compile_value(c, p));
+                        break;
+
+                    case '%':
+                        cursor_read(c);
+                        verify_call(compile_block(c, p, scope, block_op, &end));
+                        if (end) {
+                            verify(scope != SCOPE_FILE, "unmatched block terminator");
+                            verify_return();
+                        }
+                        break;
+
+                    default:
+                        program_push_text(p, c, cursor_pointer(c) - 1, 1);
+                }
+                break;
+
+            case '\\':
+                /* When a backslash precedes a curly brace or another
+                   backslash, print that character literally and skip this
+                   backslash.  Otherwise, print this backslash literally. */
+                switch (cursor_peek(c)) {
+                    case '{':
+                    case '}':
+                    case '\\':
+                        program_push_text(p, c, cursor_pointer(c), 1);
+                        cursor_read(c);
+                        break;
+                    default:
+                        program_push_text(p, c, cursor_pointer(c) - 1, 1);
+                }
+                break;
+        }
+    }
+
+    verify(scope == SCOPE_FILE, "unexpected EOF");
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup autostr_free(&block_type)
+/**
+ * Read the block type of a block inside a skipped template.  End-blocks set
+ * `end` to 1; else-blocks are ignored if `allow_else` is set.  Any other block
+ * is skipped up to its own end-block.
+ */
+static int skip_block(cursor_t *c, char allow_else, char *end)
+{
+    autostr_t *block_type = autostr();
+
+    *end = 0;
+
+    verify_call(parse_identifier(c, block_type));
+
+    if (strcmp(block_type->ptr, "end") == 0) {
+        verify_call(parse_seq(c, "%}"));
+        *end = 1;
+
+    } else if (strcmp(block_type->ptr, "else") == 0) {
+        verify(allow_else, "unexpected else marker");
+        verify_call(discard_until(c, "%}"));
+
+    } else {
+        verify_call(discard_until(c, "%}"));
+        verify_call(skip_template(c, strcmp(block_type->ptr, "if") == 0));
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+static int skip_template(cursor_t *c, char allow_else)
+{
+    char end;
+
+    for (;;) {
+
+        /* Jump straight to the next '{', '\\' or EOF. */
+        cursor_move(c, jsontpl_scan_literal(cursor_pointer(c), cursor_remaining(c)));
+
+        switch (cursor_read(c)) {
+
+            case '\0':
+                verify_fail("unexpected EOF");
+
+            case '{':
+                switch (cursor_peek(c)) {
+
+                    case '=':
+                        cursor_read(c);
+                        verify_call(discard_until(c, "=}"));
+                        break;
+
+                    case '%':
+                        cursor_read(c);
+                        verify_call(skip_block(c, allow_else, &end));
+                        if (end) {
+                            verify_return();
+                        }
+                        break;
+                }
+                break;
+
+            case '\\':
+                switch (cursor_peek(c)) {
+                    case '{':
+                    case '}':
+                    case '\\':
+                        cursor_read(c);
+                        break;
+                }
+                break;
+        }
+    }
+}
+
+
+/* Public functions: */
+
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    cursor_free(&c);                                                        \
+    jsontpl_program_free(&p);                                               \
+} while (0)
+int jsontpl_compile_program(
+        const char *template,
+        size_t len,
+        const jsontpl_env_t *env,
+        jsontpl_program_t **program)
+{
+    cursor_t *c = cursor(template, len);
+    jsontpl_program_t *p = calloc(1, sizeof(jsontpl_program_t));
+
+    p->source = template;
+    p->env = env;
+
+    verify_call_hint(compile_template(c, p, SCOPE_FILE, 0),
+        "reached line %zu, column %zu", cursor_line(c), cursor_column(c));
+
+    *program = p;
+    p = NULL;
+
+    verify_return();
+}
+
+size_t jsontpl_program_size(const jsontpl_program_t *program)
+{
+    size_t i, size = sizeof(jsontpl_program_t) + program->size * sizeof(jsontpl_op_t);
+    const jsontpl_op_t *op;
+
+    for (i = 0; i < program->len; i++) {
+        op = &program->ops[i];
+        size += name_size(op->name) + str_size(op->key) + str_size(op->value);
+    }
+    return size;
+}
+
+void jsontpl_program_free(jsontpl_program_t **program)
+{
+    size_t i;
+    jsontpl_op_t *op;
+
+    if (*program) {
+        for (i = 0; i < (*program)->len; i++) {
+            op = &(*program)->ops[i];
+            name_free(&op->name);
+            autostr_free(&op->key);
+            autostr_free(&op->value);
+        }
+        free((*program)->ops);
+        free(*program);
+        *program = NULL;
+    }
+}
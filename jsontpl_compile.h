@@ -0,0 +1,111 @@
+#ifndef JSONTPL_COMPILE_H
+#define JSONTPL_COMPILE_H
+
+#include <stdlib.h>
+
+#include "autostr.h"
+#include "jsontpl_filter.h"
+
+typedef struct jsontpl_name jsontpl_name_t;
+
+/**
+ * One piece of a name component: either a literal identifier or a variable
+ * name ({name}) whose string value is substituted when the template is
+ * rendered.  Exactly one of the two fields is set.
+ */
+typedef struct {
+    autostr_t *identifier;
+    jsontpl_name_t *variable;
+} jsontpl_part_t;
+
+/**
+ * A dot-separated component of a name.  Its key is the concatenation of its
+ * parts; `name`, `prefix_{suffix}` and `{name}` are all single components.
+ */
+typedef struct {
+    size_t count;
+    jsontpl_part_t *parts;
+} jsontpl_component_t;
+
+/**
+ * A compiled name, as used by values, if blocks and foreach blocks.
+ * `full_name` holds the name as written in the template and is only used in
+ * error messages.  The filters are looked up when the template is compiled.
+ */
+struct jsontpl_name {
+    autostr_t *full_name;
+    size_t count;
+    jsontpl_component_t *components;
+    jsontpl_chain_t filters;
+};
+
+typedef enum {
+    // Write `text_len` bytes of `text` to the output.
+    OP_TEXT,
+    // Write the value of `name` to the output.
+    OP_VALUE,
+    // Render ops up to `else_op` if `name` is truthy, or the ops from
+    //  `else_op` up to `end_op` otherwise.
+    OP_IF,
+    // Render ops up to `end_op` once for each item in `name`.
+    OP_FOREACH,
+} jsontpl_opcode;
+
+/**
+ * A single instruction.  Block instructions are followed by the instructions
+ * of their body; `end_op` is the index of the first instruction after the
+ * block, so a block that isn't rendered is skipped in one step.  `offset` is
+ * the instruction's position in the source, for error messages.
+ */
+typedef struct {
+    jsontpl_opcode code;
+    size_t offset;
+    const char *text;
+    size_t text_len;
+    jsontpl_name_t *name;
+    autostr_t *key;
+    autostr_t *value;
+    size_t else_op;
+    size_t end_op;
+} jsontpl_op_t;
+
+/**
+ * A compiled template: a flat instruction stream that can be rendered any
+ * number of times without parsing the template source again.  Literal text
+ * is not copied; OP_TEXT instructions point into the source, which must
+ * outlive the program.  So must `env`, since names point to its filters.
+ */
+typedef struct {
+    const char *source;
+    const jsontpl_env_t *env;
+    size_t size;
+    size_t len;
+    jsontpl_op_t *ops;
+} jsontpl_program_t;
+
+/**
+ * Compile the `len` bytes of the template and assign `program` to a newly
+ * allocated instruction stream.  The template needn't be NUL-terminated, so
+ * it can be compiled straight from a mapped file.  Syntax errors and unknown
+ * filters are reported here rather than during rendering.  Filters are looked
+ * up in `env` (which may be NULL) before the built-in ones.  Neither the
+ * template nor the environment may be freed before the program.
+ */
+int jsontpl_compile_program(
+        const char *template,
+        size_t len,
+        const jsontpl_env_t *env,
+        jsontpl_program_t **program);
+
+/**
+ * Return roughly how many bytes of memory the program takes up, not counting
+ * the source or the environment.
+ */
+size_t jsontpl_program_size(const jsontpl_program_t *program);
+
+/**
+ * Deallocate the program and set the pointer to NULL.
+ */
+void jsontpl_program_free(jsontpl_program_t **program);
+
+#endif // JSONTPL_COMPILE_H
@@ -1,178 +1,486 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <jansson.h>
 
 #include "autostr.h"
 #include "jsontpl_filter.h"
 #include "jsontpl_util.h"
+#include "output.h"
 #include "verify.h"
 
-#undef verify_cleanup
-#define verify_cleanup autostr_free(&transformed)
-static int transform_string(json_t **obj, int (*func)(int))
-{
-    autostr_t *transformed = autostr_apply(autostr_append(autostr(),
-        json_string_value(*obj)), func);
-    *obj = json_string(autostr_value(transformed));
-    verify_return();
-}
+#define count_of(obj) \
+    (json_is_array(obj) ? json_array_size(obj) : json_object_size(obj))
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_lower(json_t **obj)
+static int filter_count(json_t **obj)
 {
-    verify_call(transform_string(obj, tolower));
+    *obj = json_integer(count_of(*obj));
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_upper(json_t **obj)
+static int write_count(json_t *obj, output_t *out)
 {
-    verify_call(transform_string(obj, toupper));
-    verify_return();
-}
+    char number[JSONTPL_NUMBER_SIZE];
 
-#undef verify_cleanup
-#define verify_cleanup
-static int filter_identifier(json_t **obj)
-{
-    verify_call(transform_string(obj, jsontpl_toidentifier));
+    output_write(out, number, jsontpl_format_integer(count_of(obj), number));
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_count(json_t **obj)
+static int write_english(json_t *obj, output_t *out)
 {
-    *obj = json_integer(json_is_array(*obj) ?
-        json_array_size(*obj) : json_object_size(*obj));
-    verify_return();
-}
-
-#undef verify_cleanup
-#define verify_cleanup output_free(&english)
-static int filter_english(json_t **obj)
-{    
     size_t array_index;
-    size_t array_size = json_array_size(*obj);
-    output_t *english = output_str(autostr());
+    size_t array_size = json_array_size(obj);
     json_t *array_value; /* borrowed reference */
-    
-    json_array_foreach(*obj, array_index, array_value) {
+
+    json_array_foreach(obj, array_index, array_value) {
         if (array_index && array_index + 1 == array_size) {
-            output_append(english, "and ");
+            output_append(out, "and ");
         }
-        verify_call(stringify_json(array_value, NULL, english));
+        verify(!json_is_array(array_value) && !json_is_object(array_value),
+            "cannot list an array or object");
+        verify_call(stringify_json(array_value, NULL, out));
         if (array_index + 1 < array_size) {
             if (array_size > 2) {
-                output_push(english, ',');
+                output_push(out, ',');
             }
-            output_push(english, ' ');
+            output_push(out, ' ');
         }
     }
-    
-    *obj = json_string(autostr_value(output_get_str(english)));
-    
+
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_js(json_t **obj)
+static int write_js(json_t *obj, output_t *out)
 {
-    char *dump = json_dumps(*obj, JSON_ENCODE_ANY);
-    *obj = json_string(dump);
-    free(dump);
+    verify_call(encode_json(obj, out));
     verify_return();
 }
 
 #undef verify_cleanup
-#define verify_cleanup autostr_free(&str)
-static int filter_lang(jsontpl_language lang, json_t **obj)
+#define verify_cleanup
+static int write_quoted(const char *str, output_t *out)
 {
-    autostr_t *str = autostr();
-    
-    switch (json_typeof(*obj)) {
-        
+    encode_string(str, out);
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+static int write_lang(jsontpl_language lang, json_t *obj, output_t *out)
+{
+    switch (json_typeof(obj)) {
+
         case JSON_NULL:
-            autostr_append(str, (lang == LANG_C) ? "NULL" : "None");
+            output_append(out, (lang == LANG_C) ? "NULL" : "None");
             break;
-        
+
         case JSON_FALSE:
-            autostr_append(str, (lang == LANG_C) ? "0" : "False");
+            output_append(out, (lang == LANG_C) ? "0" : "False");
             break;
-        
+
         case JSON_TRUE:
-            autostr_append(str, (lang == LANG_C) ? "1" : "True");
+            output_append(out, (lang == LANG_C) ? "1" : "True");
             break;
-        
+
         case JSON_INTEGER:
         case JSON_REAL:
         case JSON_STRING:
-            verify_call(filter_js(obj));
-            verify_return();
-        
+            verify_call(encode_json(obj, out));
+            break;
+
         default:
             verify_fail("unknown JSON type");
     }
-    
-    *obj = json_string(autostr_value(str));
+
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_c(json_t **obj)
+static int write_c(json_t *obj, output_t *out)
 {
-    verify_call(filter_lang(LANG_C, obj));
+    verify_call(write_lang(LANG_C, obj, out));
     verify_return();
 }
 
 #undef verify_cleanup
 #define verify_cleanup
-static int filter_py(json_t **obj)
+static int write_py(json_t *obj, output_t *out)
 {
-    verify_call(filter_lang(LANG_PY, obj));
+    verify_call(write_lang(LANG_PY, obj, out));
     verify_return();
 }
 
-static jsontpl_filter_t filters[] = {
-    {"lower",       filter_lower,       (json_type []){JSON_STRING, -1}},
-    {"upper",       filter_upper,       (json_type []){JSON_STRING, -1}},
-    {"identifier",  filter_identifier,  (json_type []){JSON_STRING, -1}},
-    {"count",       filter_count,       (json_type []){JSON_ARRAY, JSON_OBJECT, -1}},
-    {"english",     filter_english,     (json_type []){JSON_ARRAY, -1}},
-    {"js",          filter_js,          (json_type []){JSON_FILTER_ANY_TYPE, -1}},
-    {"c",           filter_c,           (json_type []){JSON_NULL, JSON_FALSE, JSON_TRUE,
-                                                       JSON_INTEGER, JSON_REAL, JSON_STRING, -1}},
-    {"py",          filter_py,          (json_type []){JSON_NULL, JSON_FALSE, JSON_TRUE,
-                                                       JSON_INTEGER, JSON_REAL, JSON_STRING, -1}},
-    {NULL}
+#define SCALAR_TYPES (JSONTPL_FILTER_TYPE(JSON_NULL) | JSONTPL_FILTER_TYPE(JSON_FALSE) | \
+    JSONTPL_FILTER_TYPE(JSON_TRUE) | JSONTPL_FILTER_TYPE(JSON_INTEGER) |             \
+    JSONTPL_FILTER_TYPE(JSON_REAL) | JSONTPL_FILTER_TYPE(JSON_STRING))
+#define STRING_TYPE JSONTPL_FILTER_TYPE(JSON_STRING)
+#define CONTAINER_TYPES (JSONTPL_FILTER_TYPE(JSON_ARRAY) | JSONTPL_FILTER_TYPE(JSON_OBJECT))
+
+/* Sorted by name for jsontpl_filter_find. */
+static const jsontpl_filter_t filters[] = {
+    // name         func            write           write_string    map
+    //  types               result_types
+    {"c",           NULL,           write_c,        write_quoted,   NULL,
+        SCALAR_TYPES,       STRING_TYPE},
+    {"count",       filter_count,   write_count,    NULL,           NULL,
+        CONTAINER_TYPES,    JSONTPL_FILTER_TYPE(JSON_INTEGER)},
+    {"english",     NULL,           write_english,  NULL,           NULL,
+        JSONTPL_FILTER_TYPE(JSON_ARRAY), STRING_TYPE},
+    {"identifier",  NULL,           NULL,           NULL,           jsontpl_toidentifier,
+        STRING_TYPE,        STRING_TYPE},
+    {"js",          NULL,           write_js,       write_quoted,   NULL,
+        JSONTPL_FILTER_ANY_TYPE, STRING_TYPE},
+    {"lower",       NULL,           NULL,           NULL,           tolower,
+        STRING_TYPE,        STRING_TYPE},
+    {"py",          NULL,           write_py,       write_quoted,   NULL,
+        SCALAR_TYPES,       STRING_TYPE},
+    {"upper",       NULL,           NULL,           NULL,           toupper,
+        STRING_TYPE,        STRING_TYPE},
 };
 
+static int filter_cmp(const void *name, const void *filter)
+{
+    return strcmp(name, ((const jsontpl_filter_t *)filter)->name);
+}
+
+static int env_filter_cmp(const void *name, const void *filter)
+{
+    return strcmp(name, (*(jsontpl_filter_t *const *)filter)->name);
+}
+
+const jsontpl_filter_t *jsontpl_filter_find(const jsontpl_env_t *env, const char *name)
+{
+    jsontpl_filter_t **custom;
+
+    if (env && env->len) {
+        custom = bsearch(name, env->filters, env->len,
+            sizeof(env->filters[0]), env_filter_cmp);
+        if (custom) {
+            return *custom;
+        }
+    }
+
+    return bsearch(name, filters, sizeof(filters) / sizeof(filters[0]),
+        sizeof(filters[0]), filter_cmp);
+}
+
 #undef verify_cleanup
-#define verify_cleanup json_decref(unfiltered_obj)
-int jsontpl_filter(autostr_t *filter_name, json_t **obj)
+#define verify_cleanup
+int jsontpl_filter_register(
+        jsontpl_env_t *env,
+        const char *name,
+        unsigned types,
+        jsontpl_filter_func_t func,
+        jsontpl_filter_write_t write)
 {
-    json_type type;
-    json_type *type_check;
-    char valid_type = 0;
+    size_t i, len = strlen(name);
+    char *name_copy;
     jsontpl_filter_t *filter;
-    json_t *unfiltered_obj = *obj;
-    
-    for (filter = &filters[0]; filter->name != NULL; filter++) {
-        if (autostr_cmp(filter_name, filter->name) == 0) {
-            type = json_typeof(*obj);
-            for (type_check = filter->types; *type_check != -1; type_check++) {
-                if (*type_check == type || *type_check == JSON_FILTER_ANY_TYPE) {
-                    valid_type = 1;
-                    break;
-                }
-            }
-            verify(valid_type, "invalid type for filter '%s'", autostr_value(filter_name));
-            verify_call_hint(filter->func(obj), "filter '%s'", autostr_value(filter_name));
-            verify_return();
+
+    verify(len, "empty filter name");
+    for (i = 0; i < len; i++) {
+        verify(isident(name[i]), "invalid filter name '%s'", name);
+    }
+    verify(types, "filter '%s' accepts no types", name);
+    verify(func || write, "filter '%s' has no callback", name);
+
+    /* Find the insertion point, keeping the filters sorted */
+    for (i = 0; i < env->len && strcmp(env->filters[i]->name, name) < 0; i++);
+    verify(i == env->len || strcmp(env->filters[i]->name, name) != 0,
+        "filter '%s' is already registered", name);
+
+    if (env->len == env->size) {
+        env->size = env->size ? env->size * 2 : 8;
+        env->filters = realloc(env->filters,
+            env->size * sizeof(jsontpl_filter_t *));
+    }
+    memmove(&env->filters[i + 1], &env->filters[i],
+        (env->len - i) * sizeof(jsontpl_filter_t *));
+    env->len++;
+
+    name_copy = malloc(len + 1);
+    memcpy(name_copy, name, len + 1);
+    filter = malloc(sizeof(jsontpl_filter_t));
+    filter->name = name_copy;
+    filter->func = func;
+    filter->write = write;
+    filter->write_string = NULL;
+    filter->map = NULL;
+    filter->types = types;
+    /* Nothing is known about what a func returns, but text that is written
+       becomes a string. */
+    filter->result_types = func ? JSONTPL_FILTER_ANY_TYPE : STRING_TYPE;
+    env->filters[i] = filter;
+
+    verify_return();
+}
+
+/**
+ * The value passed from one stage of a chain to the next: either JSON, which
+ * is owned if `owned` is set, or the string in the scratch buffer `str`.
+ */
+typedef struct {
+    json_t *json;
+    char owned;
+    output_t *str;
+} chain_value_t;
+
+static void chain_value_release(chain_value_t *v)
+{
+    if (v->owned) {
+        json_decref(v->json);
+    }
+    v->json = NULL;
+    v->owned = 0;
+    v->str = NULL;
+}
+
+/* Turn a string in a scratch buffer into an owned JSON string. */
+static void chain_value_json(chain_value_t *v)
+{
+    if (v->str) {
+        v->json = json_string(autostr_value(output_get_str(v->str)));
+        v->owned = 1;
+        v->str = NULL;
+    }
+}
+
+/* Return an empty scratch buffer other than the one holding the value. */
+static output_t *scratch_take(jsontpl_scratch_t *scratch, chain_value_t *v)
+{
+    output_t **buffer = &scratch->buffers[scratch->buffers[0] == v->str];
+
+    if (*buffer == NULL) {
+        *buffer = output_str(autostr());
+    } else {
+        autostr_clear(output_get_str(*buffer));
+    }
+    return *buffer;
+}
+
+/* Write the string to the output through the mapping table, a chunk at a
+   time. */
+static void write_map(output_t *out, const char *str, const unsigned char *map)
+{
+    char chunk[256];
+    size_t len = 0;
+
+    for (; *str; str++) {
+        chunk[len++] = map[(unsigned char)*str];
+        if (len == sizeof(chunk)) {
+            output_write(out, chunk, len);
+            len = 0;
         }
     }
-    
-    verify_fail("unknown filter '%s'", autostr_value(filter_name));
-}
\ No newline at end of file
+    output_write(out, chunk, len);
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Apply a character mapping stage.  A string that is already in a scratch
+ * buffer is mapped in place.
+ */
+static int run_map_stage(
+        const jsontpl_stage_t *stage,
+        chain_value_t *v,
+        jsontpl_scratch_t *scratch,
+        output_t *out)
+{
+    char *p;
+    output_t *target;
+
+    if (v->str && out == NULL) {
+        for (p = output_get_str(v->str)->ptr; *p; p++) {
+            *p = stage->map[(unsigned char)*p];
+        }
+        verify_return();
+    }
+
+    if (v->str == NULL) {
+        verify(json_is_string(v->json), "invalid type for filter '%s'",
+            stage->filter->name);
+    }
+
+    target = out ? out : scratch_take(scratch, v);
+    write_map(target, v->str ? autostr_value(output_get_str(v->str)) :
+        json_string_value(v->json), stage->map);
+    chain_value_release(v);
+    if (out == NULL) {
+        v->str = target;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Apply one stage of a chain to the value, replacing it with the result, or
+ * writing the result to `out` if it's the last stage of a chain being
+ * written.
+ */
+static int run_stage(
+        const jsontpl_stage_t *stage,
+        chain_value_t *v,
+        jsontpl_scratch_t *scratch,
+        output_t *out)
+{
+    const jsontpl_filter_t *filter = stage->filter;
+    json_t *filtered;
+    output_t *target;
+
+    if (stage->map) {
+        verify_call(run_map_stage(stage, v, scratch, out));
+        verify_return();
+    }
+
+    /* A string from the previous stage goes straight into filters that take
+       plain strings.  Other filters need it as JSON. */
+    if (v->str && filter->write_string && (out || filter->func == NULL)) {
+        verify(filter->types & STRING_TYPE, "invalid type for filter '%s'", filter->name);
+        target = out ? out : scratch_take(scratch, v);
+        verify_call_hint(filter->write_string(autostr_value(output_get_str(v->str)), target),
+            "filter '%s'", filter->name);
+        v->str = out ? NULL : target;
+        verify_return();
+    }
+    chain_value_json(v);
+
+    verify(filter->types & JSONTPL_FILTER_TYPE(json_typeof(v->json)),
+        "invalid type for filter '%s'", filter->name);
+
+    if (out && filter->write) {
+        verify_call_hint(filter->write(v->json, out), "filter '%s'", filter->name);
+        chain_value_release(v);
+
+    } else if (filter->func) {
+        /* Filter functions replace the pointer without releasing the
+           original, which is only borrowed. */
+        filtered = v->json;
+        verify_call_hint(filter->func(&filtered), "filter '%s'", filter->name);
+        verify(filtered != NULL, "filter '%s' produced no value", filter->name);
+        chain_value_release(v);
+        v->json = filtered;
+        v->owned = 1;
+        if (out) {
+            verify(!json_is_array(filtered) && !json_is_object(filtered),
+                "filter '%s' produced an array or object", filter->name);
+            verify_call(stringify_json(filtered, NULL, out));
+            chain_value_release(v);
+        }
+
+    } else {
+        target = scratch_take(scratch, v);
+        verify_call_hint(filter->write(v->json, target), "filter '%s'", filter->name);
+        chain_value_release(v);
+        v->str = target;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+int jsontpl_chain_push(jsontpl_chain_t *chain, const jsontpl_filter_t *filter)
+{
+    int ch;
+    jsontpl_stage_t *stage = chain->count ? &chain->stages[chain->count - 1] : NULL;
+
+    if (stage) {
+        verify(stage->filter->result_types & filter->types,
+            "filter '%s' can't take the result of filter '%s'",
+            filter->name, stage->filter->name);
+    }
+
+    if (filter->map && stage && stage->map) {
+        for (ch = 0; ch < 256; ch++) {
+            stage->map[ch] = (unsigned char)filter->map(stage->map[ch]);
+        }
+        verify_return();
+    }
+
+    chain->stages = realloc(chain->stages, (chain->count + 1) * sizeof(jsontpl_stage_t));
+    stage = &chain->stages[chain->count++];
+    stage->filter = filter;
+    stage->map = NULL;
+
+    if (filter->map) {
+        stage->map = malloc(256);
+        for (ch = 0; ch < 256; ch++) {
+            stage->map[ch] = (unsigned char)filter->map(ch);
+        }
+    }
+
+    verify_return();
+}
+
+void jsontpl_chain_free(jsontpl_chain_t *chain)
+{
+    size_t i;
+
+    for (i = 0; i < chain->count; i++) {
+        free(chain->stages[i].map);
+    }
+    free(chain->stages);
+    chain->stages = NULL;
+    chain->count = 0;
+}
+
+#undef verify_cleanup
+#define verify_cleanup chain_value_release(&v)
+int jsontpl_chain_apply(
+        const jsontpl_chain_t *chain,
+        json_t *obj,
+        jsontpl_scratch_t *scratch,
+        json_t **filtered)
+{
+    size_t i;
+    chain_value_t v = {obj, 0, NULL};
+
+    for (i = 0; i < chain->count; i++) {
+        verify_call(run_stage(&chain->stages[i], &v, scratch, NULL));
+    }
+    chain_value_json(&v);
+
+    /* Every stage makes a new value, so the result is always owned. */
+    *filtered = v.json;
+    v.json = NULL;
+    v.owned = 0;
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup chain_value_release(&v)
+int jsontpl_chain_write(
+        const jsontpl_chain_t *chain,
+        json_t *obj,
+        jsontpl_scratch_t *scratch,
+        output_t *out)
+{
+    size_t i;
+    chain_value_t v = {obj, 0, NULL};
+
+    for (i = 0; i < chain->count; i++) {
+        verify_call(run_stage(&chain->stages[i], &v, scratch,
+            (i + 1 == chain->count) ? out : NULL));
+    }
+
+    verify_return();
+}
+
+void jsontpl_scratch_free(jsontpl_scratch_t *scratch)
+{
+    output_free(&scratch->buffers[0]);
+    output_free(&scratch->buffers[1]);
+}
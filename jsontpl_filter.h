@@ -4,20 +4,127 @@
 #include <jansson.h>
 
 #include "autostr.h"
+#include "jsontpl.h"
+#include "output.h"
 
-#define JSON_FILTER_ANY_TYPE (-2)
-
+/**
+ * A filter.  `write` writes the filtered value straight to an output, which
+ * is how a filter at the end of a value is applied, and `func` replaces the
+ * pointer with the filtered value, which is how it's applied where the result
+ * is needed as a value (in blocks and variable names).  Either may be NULL:
+ * without `func`, the written text becomes a JSON string, and without `write`,
+ * the value from `func` is written as it would be without a filter.
+ *
+ * Built-in filters may also have a `write_string`, which takes a plain string
+ * so a string made by an earlier filter in a chain doesn't need to become a
+ * JSON value first, or a `map`, which makes them character mapping filters:
+ * these are applied a byte at a time and have no other callbacks.
+ * `result_types` is what the filter can produce, for checking chains.
+ */
 typedef struct {
-    char *name;
-    int (*func)(json_t **);
-    json_type *types;
+    const char *name;
+    jsontpl_filter_func_t func;
+    jsontpl_filter_write_t write;
+    int (*write_string)(const char *, output_t *);
+    int (*map)(int);
+    unsigned types;
+    unsigned result_types;
 } jsontpl_filter_t;
 
+/**
+ * One step of a filter chain.  Consecutive character mapping filters are
+ * fused into a single step whose 256-byte `map` table applies all of them in
+ * one pass; `filter` is then the first filter of the run.
+ */
+typedef struct {
+    const jsontpl_filter_t *filter;
+    unsigned char *map;
+} jsontpl_stage_t;
+
+/**
+ * The filters of a name, in the order they are applied.
+ */
+typedef struct {
+    size_t count;
+    jsontpl_stage_t *stages;
+} jsontpl_chain_t;
+
+/**
+ * Buffers for the strings passed between the stages of a chain.  They are
+ * reused by every chain in a render, so a chain only allocates JSON values
+ * where a filter needs one.  Start from all zeros.
+ */
+typedef struct {
+    output_t *buffers[2];
+} jsontpl_scratch_t;
+
+/**
+ * Filters registered through the public API, sorted by name.  Each one is
+ * allocated separately, since compiled templates point to them.
+ */
+struct jsontpl_env {
+    size_t size;
+    size_t len;
+    jsontpl_filter_t **filters;
+};
+
 typedef enum {
     LANG_C,
     LANG_PY,
 } jsontpl_language;
 
-int jsontpl_filter(autostr_t *filter_name, json_t **obj);
+/**
+ * Return the filter with the given name from `env` (which may be NULL) or the
+ * built-in filters, or NULL if there isn't one.  Templates look up their
+ * filters once, when they are compiled.
+ */
+const jsontpl_filter_t *jsontpl_filter_find(const jsontpl_env_t *env, const char *name);
+
+/**
+ * Add a filter to the environment.  See jsontpl_env_add_filter.
+ */
+int jsontpl_filter_register(
+        jsontpl_env_t *env,
+        const char *name,
+        unsigned types,
+        jsontpl_filter_func_t func,
+        jsontpl_filter_write_t write);
+
+/**
+ * Append the filter to the chain, fusing it with the previous stage if both
+ * are character mapping filters.  Fails if the filter can't take what the
+ * previous one produces.
+ */
+int jsontpl_chain_push(jsontpl_chain_t *chain, const jsontpl_filter_t *filter);
+
+/**
+ * Deallocate the chain's stages.
+ */
+void jsontpl_chain_free(jsontpl_chain_t *chain);
+
+/**
+ * Apply the chain to `obj` and store the result, a new reference, in
+ * `filtered`.  `obj` is only read, so filters can run on a shared document.
+ */
+int jsontpl_chain_apply(
+        const jsontpl_chain_t *chain,
+        json_t *obj,
+        jsontpl_scratch_t *scratch,
+        json_t **filtered);
+
+/**
+ * Apply the chain to `obj` and write the result to `out`.  The last stage
+ * writes straight to the output, without making a JSON value.
+ */
+int jsontpl_chain_write(
+        const jsontpl_chain_t *chain,
+        json_t *obj,
+        jsontpl_scratch_t *scratch,
+        output_t *out);
+
+/**
+ * Deallocate the scratch buffers.
+ */
+void jsontpl_scratch_free(jsontpl_scratch_t *scratch);
 
 #endif // JSONTPL_FILTER_H
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif // _WIN32
+
+#include "jsontpl.h"
+#include "jsontpl_pool.h"
+
+#ifndef _WIN32
+
+/**
+ * The tasks of one jsontpl_pool_run call.  `next` is the next index to hand
+ * out and `done` the number of tasks finished or cancelled.  Batches with
+ * indices left to hand out are queued on the pool; the batch itself lives on
+ * the caller's stack until `done` reaches `count`.
+ */
+typedef struct jsontpl_batch {
+    jsontpl_task_t task;
+    void *arg;
+    size_t count;
+    size_t next;
+    size_t done;
+    struct jsontpl_batch *next_batch;
+} jsontpl_batch_t;
+
+struct jsontpl_pool {
+    size_t threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    // Signalled when a batch is queued or the pool is stopping
+    pthread_cond_t work;
+    // Broadcast when a batch finishes
+    pthread_cond_t finished;
+    jsontpl_batch_t *queue;
+    char stop;
+};
+
+/* Remove the batch from the queue once all of its indices are handed out.
+   The pool must be locked. */
+static void batch_dequeue(jsontpl_pool_t *pool, jsontpl_batch_t *batch)
+{
+    jsontpl_batch_t **link;
+
+    for (link = &pool->queue; *link; link = &(*link)->next_batch) {
+        if (*link == batch) {
+            *link = batch->next_batch;
+            return;
+        }
+    }
+}
+
+/* Hand out the batch's next index and run its task with the pool unlocked.
+   The pool must be locked. */
+static void batch_step(jsontpl_pool_t *pool, jsontpl_batch_t *batch)
+{
+    size_t index = batch->next++;
+    size_t finished = 1;
+    int failed;
+
+    if (batch->next == batch->count) {
+        batch_dequeue(pool, batch);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    failed = batch->task(batch->arg, index);
+    pthread_mutex_lock(&pool->lock);
+
+    /* Cancel the tasks that haven't been handed out */
+    if (failed && batch->next < batch->count) {
+        finished += batch->count - batch->next;
+        batch->next = batch->count;
+        batch_dequeue(pool, batch);
+    }
+
+    /* The batch may be gone as soon as the last task is counted. */
+    batch->done += finished;
+    if (batch->done == batch->count) {
+        pthread_cond_broadcast(&pool->finished);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    jsontpl_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->queue == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->queue == NULL) break;
+        batch_step(pool, pool->queue);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+#else // _WIN32
+
+/* Without pthreads, batches always run on the calling thread. */
+struct jsontpl_pool {
+    size_t threads;
+};
+
+#endif // _WIN32
+
+
+/* Public functions: */
+
+
+jsontpl_pool_t *jsontpl_pool_new(size_t threads)
+{
+    jsontpl_pool_t *pool = calloc(1, sizeof(jsontpl_pool_t));
+#ifndef _WIN32
+    size_t i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    /* The caller of each batch is one of its threads */
+    if (threads > 1) {
+        pool->workers = malloc((threads - 1) * sizeof(pthread_t));
+        for (i = 0; i + 1 < threads; i++) {
+            if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0) {
+                break;
+            }
+            pool->threads++;
+        }
+    }
+#endif // _WIN32
+
+    return pool;
+}
+
+size_t jsontpl_pool_size(jsontpl_pool_t *pool)
+{
+    return pool ? pool->threads + 1 : 1;
+}
+
+void jsontpl_pool_run(
+        jsontpl_pool_t *pool,
+        size_t count,
+        jsontpl_task_t task,
+        void *arg)
+{
+    size_t i;
+#ifndef _WIN32
+    jsontpl_batch_t batch = {task, arg, count, 0, 0, NULL};
+
+    if (pool && pool->threads && count > 1) {
+        pthread_mutex_lock(&pool->lock);
+        batch.next_batch = pool->queue;
+        pool->queue = &batch;
+        pthread_cond_broadcast(&pool->work);
+
+        while (batch.next < batch.count) {
+            batch_step(pool, &batch);
+        }
+        while (batch.done < batch.count) {
+            pthread_cond_wait(&pool->finished, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+#endif // _WIN32
+
+    for (i = 0; i < count; i++) {
+        if (task(arg, i)) break;
+    }
+}
+
+void jsontpl_pool_free(jsontpl_pool_t **pool)
+{
+#ifndef _WIN32
+    size_t i;
+#endif // _WIN32
+
+    if (*pool) {
+#ifndef _WIN32
+        pthread_mutex_lock(&(*pool)->lock);
+        (*pool)->stop = 1;
+        pthread_cond_broadcast(&(*pool)->work);
+        pthread_mutex_unlock(&(*pool)->lock);
+
+        for (i = 0; i < (*pool)->threads; i++) {
+            pthread_join((*pool)->workers[i], NULL);
+        }
+        free((*pool)->workers);
+        pthread_mutex_destroy(&(*pool)->lock);
+        pthread_cond_destroy(&(*pool)->work);
+        pthread_cond_destroy(&(*pool)->finished);
+#endif // _WIN32
+        free(*pool);
+        *pool = NULL;
+    }
+}
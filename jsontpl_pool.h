@@ -0,0 +1,35 @@
+#ifndef JSONTPL_POOL_H
+#define JSONTPL_POOL_H
+
+#include <stdlib.h>
+
+#include "jsontpl.h"
+
+/**
+ * A task run by the pool: `index` is which of the batch's tasks this is.
+ * Returning nonzero cancels the batch's tasks that haven't started yet.
+ */
+typedef int (*jsontpl_task_t)(void *arg, size_t index);
+
+/**
+ * Run `task` once for each index from 0 to `count` - 1 on the pool's threads
+ * and return when all of them have finished.  Indices are started in order,
+ * so when a task fails, every task before it has been started and only later
+ * ones are cancelled.  The calling thread runs tasks too, so a batch always
+ * makes progress even while the workers are busy with other callers' batches,
+ * and any number of threads can run batches on the same pool at once.  With a
+ * NULL pool, or one without workers, the tasks run in order on the calling
+ * thread.
+ */
+void jsontpl_pool_run(
+        jsontpl_pool_t *pool,
+        size_t count,
+        jsontpl_task_t task,
+        void *arg);
+
+/**
+ * Return the number of threads that run a batch, counting the caller.
+ */
+size_t jsontpl_pool_size(jsontpl_pool_t *pool);
+
+#endif // JSONTPL_POOL_H
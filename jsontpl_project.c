@@ -0,0 +1,707 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "autostr.h"
+#include "cursor.h"
+#include "jsontpl_compile.h"
+#include "jsontpl_project.h"
+#include "jsontpl_util.h"
+#include "verify.h"
+
+/* Containers nested deeper than this are rejected, as jansson does. */
+#define PROJECT_MAX_DEPTH 2048
+
+/**
+ * A loop variable seen while working out the paths.  `node` is where the
+ * variable's values come from, or NULL for a foreach block's key, which needs
+ * nothing from the input.
+ */
+typedef struct {
+    const char *name;
+    jsontpl_paths_t *node;
+} paths_binding_t;
+
+typedef struct {
+    jsontpl_program_t *program;
+    jsontpl_paths_t *root;
+    size_t bindings_size;
+    size_t bindings_len;
+    paths_binding_t *bindings;
+    // Set when a name starts with a variable component
+    char dynamic;
+} paths_state_t;
+
+/**
+ * A read position in the JSON text, which isn't NUL-terminated.
+ */
+typedef struct {
+    const char *json;
+    size_t len;
+    size_t pos;
+    size_t depth;
+} scanner_t;
+
+#define scan_peek(sc) ((sc)->pos < (sc)->len ? (sc)->json[(sc)->pos] : '\0')
+#define scan_error(sc, message) JSONTPL_JSON_ERROR, (message),              \
+    (int)cursor_line_at((sc)->json, (sc)->pos),                             \
+    (int)cursor_column_at((sc)->json, (sc)->pos)
+
+static jsontpl_paths_t *paths_new(const char *key, size_t key_len)
+{
+    jsontpl_paths_t *node = calloc(1, sizeof(jsontpl_paths_t));
+
+    if (key) {
+        node->key = malloc(key_len + 1);
+        memcpy(node->key, key, key_len);
+        node->key[key_len] = '\0';
+        node->key_len = key_len;
+    }
+    return node;
+}
+
+/* Return the node's child for the key, adding it if it doesn't exist. */
+static jsontpl_paths_t *paths_child(jsontpl_paths_t *node, const char *key)
+{
+    size_t i, key_len = strlen(key);
+
+    for (i = 0; i < node->count; i++) {
+        if (strcmp(node->children[i]->key, key) == 0) {
+            return node->children[i];
+        }
+    }
+
+    node->children = realloc(node->children,
+        (node->count + 1) * sizeof(jsontpl_paths_t *));
+    return node->children[node->count++] = paths_new(key, key_len);
+}
+
+static jsontpl_paths_t *paths_wildcard(jsontpl_paths_t *node)
+{
+    if (node->wildcard == NULL) {
+        node->wildcard = paths_new(NULL, 0);
+    }
+    return node->wildcard;
+}
+
+/* Add everything in `src` to `dst`. */
+static void paths_merge(jsontpl_paths_t *dst, const jsontpl_paths_t *src)
+{
+    size_t i;
+
+    dst->whole |= src->whole;
+    if (src->wildcard) {
+        paths_merge(paths_wildcard(dst), src->wildcard);
+    }
+    for (i = 0; i < src->count; i++) {
+        paths_merge(paths_child(dst, src->children[i]->key), src->children[i]);
+    }
+}
+
+/* Merge each node's wildcard into its named children, so that a key only
+   needs to be looked up in one place when the input is loaded. */
+static void paths_normalize(jsontpl_paths_t *node)
+{
+    size_t i;
+
+    for (i = 0; i < node->count; i++) {
+        if (node->wildcard) {
+            paths_merge(node->children[i], node->wildcard);
+        }
+        paths_normalize(node->children[i]);
+    }
+    if (node->wildcard) {
+        paths_normalize(node->wildcard);
+    }
+}
+
+/* Return the component's key if it doesn't depend on variables, or NULL.
+   The key is assembled in `key`. */
+static const char *static_key(jsontpl_component_t *component, autostr_t **key)
+{
+    size_t i;
+
+    autostr_recycle(key);
+    for (i = 0; i < component->count; i++) {
+        if (component->parts[i].variable) {
+            return NULL;
+        }
+        autostr_append(*key, autostr_value(component->parts[i].identifier));
+    }
+    return autostr_value(*key);
+}
+
+#undef verify_cleanup
+#define verify_cleanup autostr_free(&scratch)
+/**
+ * Add the paths that the name can reference.  If `whole` is set (or the name
+ * has filters), its whole value is needed; otherwise only the parts that are
+ * added later through `node`, which is set to the name's node, or NULL if it
+ * has none.
+ */
+static int paths_name(
+        paths_state_t *st,
+        jsontpl_name_t *name,
+        char whole,
+        jsontpl_paths_t **node)
+{
+    size_t i, j;
+    const char *key;
+    autostr_t *scratch = NULL;
+    jsontpl_component_t *component;
+    char bound = 0;
+
+    *node = NULL;
+
+    /* Variables are names of their own, whose values make up the key */
+    for (i = 0; i < name->count; i++) {
+        component = &name->components[i];
+        for (j = 0; j < component->count; j++) {
+            if (component->parts[j].variable) {
+                verify_call(paths_name(st, component->parts[j].variable, 1, node));
+            }
+        }
+    }
+    *node = NULL;
+
+    /* A variable first component could name anything, loop variables
+       included, so there's no telling which parts of the input it needs. */
+    key = static_key(&name->components[0], &scratch);
+    if (key == NULL) {
+        st->dynamic = 1;
+        verify_return();
+    }
+
+    /* Loop variables are looked up first, as they are when rendering */
+    for (i = st->bindings_len; i-- > 0; ) {
+        if (strcmp(st->bindings[i].name, key) == 0) {
+            *node = st->bindings[i].node;
+            bound = 1;
+            break;
+        }
+    }
+    if (!bound) {
+        *node = paths_child(st->root, key);
+    }
+
+    for (i = 1; *node && i < name->count; i++) {
+        key = static_key(&name->components[i], &scratch);
+        *node = key ? paths_child(*node, key) : paths_wildcard(*node);
+    }
+
+    if (*node && (whole || name->filters.count)) {
+        (*node)->whole = 1;
+    }
+
+    verify_return();
+}
+
+static void paths_bind(paths_state_t *st, autostr_t *name, jsontpl_paths_t *node)
+{
+    if (st->bindings_len == st->bindings_size) {
+        st->bindings_size = st->bindings_size ? st->bindings_size * 2 : 8;
+        st->bindings = realloc(st->bindings,
+            st->bindings_size * sizeof(paths_binding_t));
+    }
+    st->bindings[st->bindings_len].name = autostr_value(name);
+    st->bindings[st->bindings_len].node = node;
+    st->bindings_len++;
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Add the paths referenced by the instructions from `start` up to `end`.
+ */
+static int paths_ops(paths_state_t *st, size_t start, size_t end)
+{
+    size_t index = start;
+    size_t bindings_len;
+    jsontpl_op_t *op;
+    jsontpl_paths_t *node;
+
+    while (index < end) {
+        op = &st->program->ops[index];
+
+        switch (op->code) {
+
+            case OP_TEXT:
+                index++;
+                break;
+
+            case OP_VALUE:
+                verify_call(paths_name(st, op->name, 1, &node));
+                index++;
+                break;
+
+            case OP_IF:
+                /* Both branches follow the if instruction */
+                verify_call(paths_name(st, op->name, 1, &node));
+                verify_call(paths_ops(st, index + 1, op->end_op));
+                index = op->end_op;
+                break;
+
+            case OP_FOREACH:
+                /* Every item is needed, but only as much of each one as the
+                   block uses through the loop variable. */
+                verify_call(paths_name(st, op->name, 0, &node));
+                bindings_len = st->bindings_len;
+                if (op->key) {
+                    paths_bind(st, op->key, NULL);
+                }
+                paths_bind(st, op->value, node ? paths_wildcard(node) : NULL);
+                verify_call(paths_ops(st, index + 1, op->end_op));
+                st->bindings_len = bindings_len;
+                index = op->end_op;
+                break;
+
+            default:
+                verify_fail("internal error: unknown instruction");
+        }
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip a JSON string, checking its escapes.
+ */
+static int skip_string(scanner_t *sc)
+{
+    int i;
+    unsigned char ch;
+
+    sc->pos++;
+    while (sc->pos < sc->len) {
+        ch = sc->json[sc->pos++];
+        if (ch == '"') {
+            verify_return();
+        }
+        verify(ch >= 0x20, scan_error(sc, "control character in string"));
+        if (ch == '\\') {
+            ch = scan_peek(sc);
+            verify(ch && strchr("\"\\/bfnrtu", ch), scan_error(sc, "invalid escape"));
+            sc->pos++;
+            if (ch == 'u') {
+                for (i = 0; i < 4; i++, sc->pos++) {
+                    verify(strchr("0123456789abcdefABCDEF", scan_peek(sc)) && scan_peek(sc),
+                        scan_error(sc, "invalid escape"));
+                }
+            }
+        }
+    }
+
+    verify_fail(scan_error(sc, "premature end of input in string"));
+}
+
+/* Skip the digits at the position and return how many there were. */
+static size_t skip_digits(scanner_t *sc)
+{
+    size_t start = sc->pos;
+
+    while (scan_peek(sc) >= '0' && scan_peek(sc) <= '9') sc->pos++;
+    return sc->pos - start;
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip a JSON number.
+ */
+static int skip_number(scanner_t *sc)
+{
+    if (scan_peek(sc) == '-') sc->pos++;
+    if (scan_peek(sc) == '0') {
+        sc->pos++;
+        verify(skip_digits(sc) == 0, scan_error(sc, "invalid number"));
+    } else {
+        verify(skip_digits(sc), scan_error(sc, "invalid number"));
+    }
+    if (scan_peek(sc) == '.') {
+        sc->pos++;
+        verify(skip_digits(sc), scan_error(sc, "invalid number"));
+    }
+    if (scan_peek(sc) == 'e' || scan_peek(sc) == 'E') {
+        sc->pos++;
+        if (scan_peek(sc) == '+' || scan_peek(sc) == '-') sc->pos++;
+        verify(skip_digits(sc), scan_error(sc, "invalid number"));
+    }
+
+    verify_return();
+}
+
+static void skip_blank(scanner_t *sc)
+{
+    char ch;
+
+    while ((ch = scan_peek(sc)) == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
+        sc->pos++;
+    }
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip past a ',' between items, or past the closing bracket and set `done`.
+ */
+static int skip_separator(scanner_t *sc, char close, char *done)
+{
+    skip_blank(sc);
+    if (scan_peek(sc) == close) {
+        sc->pos++;
+        sc->depth--;
+        *done = 1;
+    } else {
+        verify(scan_peek(sc) == ',', scan_error(sc, close == '}' ?
+            "expected ',' or '}'" : "expected ',' or ']'"));
+        sc->pos++;
+        skip_blank(sc);
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip past the opening bracket of a container and any blanks, and set
+ * `done` if the container is empty.
+ */
+static int skip_open(scanner_t *sc, char close, char *done)
+{
+    sc->pos++;
+    sc->depth++;
+    verify(sc->depth <= PROJECT_MAX_DEPTH, scan_error(sc, "maximum nesting depth exceeded"));
+    skip_blank(sc);
+    *done = 0;
+    if (scan_peek(sc) == close) {
+        sc->pos++;
+        sc->depth--;
+        *done = 1;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip an object key and the colon after it.
+ */
+static int skip_key(scanner_t *sc)
+{
+    verify(scan_peek(sc) == '"', scan_error(sc, "string or '}' expected"));
+    verify_call(skip_string(sc));
+    skip_blank(sc);
+    verify(scan_peek(sc) == ':', scan_error(sc, "':' expected"));
+    sc->pos++;
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip any JSON value, checking that it's well-formed.
+ */
+static int skip_value(scanner_t *sc)
+{
+    char done;
+
+    skip_blank(sc);
+
+    switch (scan_peek(sc)) {
+
+        case '"':
+            verify_call(skip_string(sc));
+            break;
+
+        case '{':
+            verify_call(skip_open(sc, '}', &done));
+            while (!done) {
+                verify_call(skip_key(sc));
+                verify_call(skip_value(sc));
+                verify_call(skip_separator(sc, '}', &done));
+            }
+            break;
+
+        case '[':
+            verify_call(skip_open(sc, ']', &done));
+            while (!done) {
+                verify_call(skip_value(sc));
+                verify_call(skip_separator(sc, ']', &done));
+            }
+            break;
+
+        case 't':
+            verify(sc->len - sc->pos >= 4 && memcmp(&sc->json[sc->pos], "true", 4) == 0,
+                scan_error(sc, "invalid token"));
+            sc->pos += 4;
+            break;
+
+        case 'f':
+            verify(sc->len - sc->pos >= 5 && memcmp(&sc->json[sc->pos], "false", 5) == 0,
+                scan_error(sc, "invalid token"));
+            sc->pos += 5;
+            break;
+
+        case 'n':
+            verify(sc->len - sc->pos >= 4 && memcmp(&sc->json[sc->pos], "null", 4) == 0,
+                scan_error(sc, "invalid token"));
+            sc->pos += 4;
+            break;
+
+        case '\0':
+            verify_fail(scan_error(sc, "unexpected end of input"));
+
+        default:
+            verify(scan_peek(sc) == '-' || (scan_peek(sc) >= '0' && scan_peek(sc) <= '9'),
+                scan_error(sc, "invalid token"));
+            verify_call(skip_number(sc));
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Skip the value and decode it with jansson.
+ */
+static int decode_value(scanner_t *sc, json_t **value)
+{
+    size_t start, end;
+    json_error_t error;
+
+    skip_blank(sc);
+    start = sc->pos;
+    verify_call(skip_value(sc));
+    end = sc->pos;
+
+    *value = json_loadb(sc->json + start, end - start,
+        JSON_DECODE_ANY | JSON_REJECT_DUPLICATES, &error);
+    if (!*value) {
+        /* Report the error at the start of the value */
+        sc->pos = start;
+        verify_fail(scan_error(sc, error.text));
+    }
+
+    verify_return();
+}
+
+static int load_value(scanner_t *sc, const jsontpl_paths_t *node, json_t **value);
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    json_decref(decoded);                                                   \
+    autostr_free(&key);                                                     \
+} while (0)
+/**
+ * Load the members of an object that the node needs into `object`, skipping
+ * the others.
+ */
+static int load_object(scanner_t *sc, const jsontpl_paths_t *node, json_t *object)
+{
+    size_t i, start, raw_len;
+    const char *raw;
+    char done;
+    json_t *decoded = NULL;
+    json_t *member;
+    autostr_t *key = NULL;
+    const jsontpl_paths_t *child;
+
+    verify_call(skip_open(sc, '}', &done));
+
+    while (!done) {
+        start = sc->pos;
+        verify_call(skip_key(sc));
+
+        /* The key as written, without the quotes, unless it has escapes */
+        raw = sc->json + start + 1;
+        raw_len = 0;
+        while (raw[raw_len] != '"') {
+            if (raw[raw_len] == '\\') break;
+            raw_len++;
+        }
+        json_decref(decoded);
+        decoded = NULL;
+        if (raw[raw_len] != '"') {
+            decoded = json_loadb(sc->json + start, sc->pos - start - 1,
+                JSON_DECODE_ANY, NULL);
+            verify(decoded, scan_error(sc, "invalid object key"));
+            raw = json_string_value(decoded);
+            raw_len = strlen(raw);
+        }
+
+        child = node->wildcard;
+        for (i = 0; i < node->count; i++) {
+            if (node->children[i]->key_len == raw_len &&
+                    memcmp(node->children[i]->key, raw, raw_len) == 0) {
+                child = node->children[i];
+                break;
+            }
+        }
+
+        if (child) {
+            autostr_recycle(&key);
+            autostr_append_len(key, raw, raw_len);
+            verify(json_object_get(object, autostr_value(key)) == NULL,
+                scan_error(sc, "duplicate object key"));
+            verify_call(load_value(sc, child, &member));
+            json_object_set_new(object, autostr_value(key), member);
+        } else {
+            verify_call(skip_value(sc));
+        }
+
+        verify_call(skip_separator(sc, '}', &done));
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Load the items of an array into `array` if the node needs them, or skip
+ * them otherwise.
+ */
+static int load_array(scanner_t *sc, const jsontpl_paths_t *node, json_t *array)
+{
+    char done;
+    json_t *item;
+
+    verify_call(skip_open(sc, ']', &done));
+
+    while (!done) {
+        if (node->wildcard) {
+            verify_call(load_value(sc, node->wildcard, &item));
+            json_array_append_new(array, item);
+        } else {
+            verify_call(skip_value(sc));
+        }
+        verify_call(skip_separator(sc, ']', &done));
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup json_decref(result)
+/**
+ * Load as much of the value as the node needs.  Containers that are only
+ * partly needed are built here; anything else is decoded by jansson.
+ */
+static int load_value(scanner_t *sc, const jsontpl_paths_t *node, json_t **value)
+{
+    json_t *result = NULL;
+
+    skip_blank(sc);
+
+    if (!node->whole && scan_peek(sc) == '{') {
+        result = json_object();
+        verify_call(load_object(sc, node, result));
+    } else if (!node->whole && scan_peek(sc) == '[') {
+        result = json_array();
+        verify_call(load_array(sc, node, result));
+    } else {
+        verify_call(decode_value(sc, &result));
+    }
+
+    *value = result;
+    result = NULL;
+
+    verify_return();
+}
+
+
+/* Public functions: */
+
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    free(st.bindings);                                                      \
+    jsontpl_paths_free(&st.root);                                           \
+} while (0)
+int jsontpl_paths_build(jsontpl_program_t *program, jsontpl_paths_t **paths)
+{
+    paths_state_t st = {program, paths_new(NULL, 0), 0, 0, NULL, 0};
+
+    verify_call(paths_ops(&st, 0, program->len));
+
+    *paths = NULL;
+    if (!st.dynamic) {
+        paths_normalize(st.root);
+        *paths = st.root;
+        st.root = NULL;
+    }
+
+    verify_return();
+}
+
+jsontpl_paths_t *jsontpl_paths_union(jsontpl_paths_t **paths, size_t count)
+{
+    size_t i;
+    jsontpl_paths_t *result;
+
+    for (i = 0; i < count; i++) {
+        if (paths[i] == NULL) return NULL;
+    }
+
+    result = paths_new(NULL, 0);
+    for (i = 0; i < count; i++) {
+        paths_merge(result, paths[i]);
+    }
+    /* A wildcard from one tree may not have reached another's children */
+    paths_normalize(result);
+    return result;
+}
+
+void jsontpl_paths_free(jsontpl_paths_t **paths)
+{
+    size_t i;
+
+    if (*paths) {
+        for (i = 0; i < (*paths)->count; i++) {
+            jsontpl_paths_free(&(*paths)->children[i]);
+        }
+        free((*paths)->children);
+        jsontpl_paths_free(&(*paths)->wildcard);
+        free((*paths)->key);
+        free(*paths);
+        *paths = NULL;
+    }
+}
+
+#undef verify_cleanup
+#define verify_cleanup json_decref(result)
+int jsontpl_paths_load(
+        const jsontpl_paths_t *paths,
+        const char *json,
+        size_t len,
+        json_t **root)
+{
+    scanner_t sc = {json, len, 0, 0};
+    json_t *result = NULL;
+    json_error_t error;
+
+    if (paths == NULL) {
+        result = json_loadb(json, len, JSON_REJECT_DUPLICATES, &error);
+        verify(result, JSONTPL_JSON_ERROR, error.text, error.line, error.column);
+    } else {
+        skip_blank(&sc);
+        verify(scan_peek(&sc) == '{', "root is not an object");
+        result = json_object();
+        verify_call(load_object(&sc, paths, result));
+        skip_blank(&sc);
+        verify(sc.pos == sc.len, scan_error(&sc, "end of file expected"));
+    }
+    verify(json_is_object(result), "root is not an object");
+
+    *root = result;
+    result = NULL;
+
+    verify_return();
+}
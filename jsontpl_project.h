@@ -0,0 +1,57 @@
+#ifndef JSONTPL_PROJECT_H
+#define JSONTPL_PROJECT_H
+
+#include <stdlib.h>
+#include <jansson.h>
+
+#include "jsontpl_compile.h"
+
+/**
+ * The parts of the JSON input that a program can reference, as a tree of
+ * keys rooted at the root object.  A node is `whole` if its entire value is
+ * needed; otherwise only its `children` are.  `wildcard` stands for every
+ * key of an object or element of an array, for foreach blocks and names with
+ * variable components.  When a node has both, the wildcard has already been
+ * merged into each named child.
+ */
+typedef struct jsontpl_paths {
+    char *key;
+    size_t key_len;
+    char whole;
+    struct jsontpl_paths *wildcard;
+    size_t count;
+    struct jsontpl_paths **children;
+} jsontpl_paths_t;
+
+/**
+ * Work out which parts of the JSON input the program can reference and
+ * assign `paths` to them.  `paths` is set to NULL if that can't be known
+ * statically (when a name starts with a variable component), in which case
+ * the whole input is needed.
+ */
+int jsontpl_paths_build(jsontpl_program_t *program, jsontpl_paths_t **paths);
+
+/**
+ * Return the parts of the JSON input that any of the `count` trees of paths
+ * need, as a new tree, or NULL if one of them needs the whole input.
+ */
+jsontpl_paths_t *jsontpl_paths_union(jsontpl_paths_t **paths, size_t count);
+
+/**
+ * Deallocate the paths and set the pointer to NULL.
+ */
+void jsontpl_paths_free(jsontpl_paths_t **paths);
+
+/**
+ * Decode the `len` bytes of JSON text into `root`, which must be an object,
+ * materializing only the values in `paths` (everything, if `paths` is NULL).
+ * The rest of the text is checked for well-formed syntax and skipped without
+ * allocating anything; it isn't checked for valid UTF-8 or duplicate keys.
+ */
+int jsontpl_paths_load(
+        const jsontpl_paths_t *paths,
+        const char *json,
+        size_t len,
+        json_t **root);
+
+#endif // JSONTPL_PROJECT_H
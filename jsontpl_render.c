@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "autostr.h"
+#include "cursor.h"
+#include "jsontpl_arena.h"
+#include "jsontpl_compile.h"
+#include "jsontpl_filter.h"
+#include "jsontpl_pool.h"
+#include "jsontpl_render.h"
+#include "jsontpl_util.h"
+#include "output.h"
+#include "verify.h"
+
+/* Size of the arena buffer on the stack of each render.  Most renders never
+   need more, so they don't allocate anything besides filter results. */
+#define JSONTPL_RENDER_ARENA 1024
+
+/* Items per chunk of a parallel foreach block, and chunks per thread in each
+   wave.  Rendering in waves bounds the buffered output to a few chunks per
+   thread rather than the whole block. */
+#define JSONTPL_PARALLEL_CHUNK 256
+#define JSONTPL_PARALLEL_WAVE 4
+
+/**
+ * A value that a name resolves to.  Object keys bound by a foreach block are
+ * plain strings, so they don't need a JSON string allocated for every
+ * iteration; for those, `key` is set and `json` is NULL.
+ *
+ * `json` is normally a borrowed reference into the root, whose reference
+ * count is never touched, so any number of threads can render against the
+ * same root.  Only values made by filters are owned, and `owned` is set for
+ * those.
+ */
+typedef struct {
+    json_t *json;
+    const char *key;
+    char owned;
+} jsontpl_value_t;
+
+/**
+ * A loop variable.  `name` is the foreach block's identifier.
+ */
+typedef struct {
+    const char *name;
+    jsontpl_value_t value;
+} jsontpl_binding_t;
+
+/**
+ * Everything a render needs besides the current instruction.  Loop variables
+ * live on the `bindings` stack, which is searched before the root object, so
+ * the root is never modified.  The stack and any keys assembled from variable
+ * names are allocated from `arena`, which is released when the render ends.
+ * `parallel` is NULL if foreach blocks are rendered serially, which includes
+ * the chunks of a parallel block.
+ */
+typedef struct {
+    jsontpl_program_t *program;
+    const jsontpl_parallel_t *parallel;
+    json_t *root;
+    output_t *out;
+    size_t bindings_size;
+    size_t bindings_len;
+    jsontpl_binding_t *bindings;
+    jsontpl_scratch_t scratch;
+    jsontpl_arena_t arena;
+} jsontpl_state_t;
+
+/**
+ * Render the instructions from `start` up to (but not including) `end`.
+ */
+static int render_ops(jsontpl_state_t *s, size_t start, size_t end);
+
+static int resolve_name(
+        jsontpl_state_t *s,
+        jsontpl_name_t *name,
+        jsontpl_value_t *value);
+
+/* Release the value if it's owned and reset it. */
+static void value_release(jsontpl_value_t *value)
+{
+    if (value->owned) {
+        json_decref(value->json);
+    }
+    value->json = NULL;
+    value->key = NULL;
+    value->owned = 0;
+}
+
+/* Push a loop variable and return its index.  Bindings are addressed by
+   index, since pushing may move them. */
+static size_t binding_push(jsontpl_state_t *s, const char *name)
+{
+    jsontpl_binding_t *binding;
+
+    if (s->bindings_len == s->bindings_size) {
+        s->bindings_size = s->bindings_size ? s->bindings_size * 2 : 8;
+        s->bindings = jsontpl_arena_grow(&s->arena, s->bindings,
+            s->bindings_len * sizeof(jsontpl_binding_t),
+            s->bindings_size * sizeof(jsontpl_binding_t));
+    }
+    binding = &s->bindings[s->bindings_len];
+    binding->name = name;
+    binding->value.json = NULL;
+    binding->value.key = NULL;
+    binding->value.owned = 0;
+
+    return s->bindings_len++;
+}
+
+/* Look up `key` in `context`, or among the loop variables and then in the
+   root object if `context` is NULL.  Sets `found` to 0 if it doesn't exist. */
+static void lookup(
+        jsontpl_state_t *s,
+        json_t *context,
+        const char *key,
+        jsontpl_value_t *value,
+        char *found)
+{
+    size_t i;
+
+    value->json = NULL;
+    value->key = NULL;
+    value->owned = 0;
+
+    if (context == NULL) {
+        for (i = s->bindings_len; i-- > 0; ) {
+            if (strcmp(s->bindings[i].name, key) == 0) {
+                *value = s->bindings[i].value;
+                *found = 1;
+                return;
+            }
+        }
+        context = s->root;
+    }
+
+    value->json = json_object_get(context, key);
+    *found = value->json != NULL;
+}
+
+#undef verify_cleanup
+#define verify_cleanup value_release(&variable)
+/**
+ * Assign `key` to the key that the name component refers to.  Components made
+ * of a single identifier are used as is; anything else is assembled in the
+ * arena, where it stays until the caller resets it.
+ */
+static int component_key(
+        jsontpl_state_t *s,
+        jsontpl_component_t *component,
+        const char **key)
+{
+    size_t i, len = 0;
+    const char **strings;
+    size_t *lengths;
+    char *buffer;
+    jsontpl_part_t *part;
+    jsontpl_value_t variable = {NULL, NULL, 0};
+
+    if (component->count == 1 && component->parts[0].identifier) {
+        *key = autostr_value(component->parts[0].identifier);
+        verify_return();
+    }
+
+    /* Resolve every part before assembling the key, since resolving a
+       variable can allocate from the arena as well. */
+    strings = jsontpl_arena_alloc(&s->arena, component->count * sizeof(char *));
+    lengths = jsontpl_arena_alloc(&s->arena, component->count * sizeof(size_t));
+
+    for (i = 0; i < component->count; i++) {
+        part = &component->parts[i];
+        if (part->identifier) {
+            strings[i] = autostr_value(part->identifier);
+            lengths[i] = autostr_len(part->identifier);
+        } else {
+            verify_call(resolve_name(s, part->variable, &variable));
+            verify(variable.key || json_is_string(variable.json),
+                "%s: not a string", part->variable->full_name->ptr);
+            strings[i] = variable.key ? variable.key : json_string_value(variable.json);
+            lengths[i] = strlen(strings[i]);
+            /* Filter results are released right away, so keep a copy */
+            if (variable.owned) {
+                buffer = jsontpl_arena_alloc(&s->arena, lengths[i]);
+                memcpy(buffer, strings[i], lengths[i]);
+                strings[i] = buffer;
+            }
+            value_release(&variable);
+        }
+        len += lengths[i];
+    }
+
+    buffer = jsontpl_arena_alloc(&s->arena, len + 1);
+    *key = buffer;
+    for (i = 0; i < component->count; i++) {
+        memcpy(buffer, strings[i], lengths[i]);
+        buffer += lengths[i];
+    }
+    *buffer = '\0';
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup jsontpl_arena_reset(&s->arena, mark)
+/**
+ * Look up the value that the name identifies, without applying its filter,
+ * and store it in `value`.  Both fields are set to NULL if the last component
+ * of the name doesn't exist.
+ */
+static int lookup_name(
+        jsontpl_state_t *s,
+        jsontpl_name_t *name,
+        jsontpl_value_t *value)
+{
+    size_t i;
+    char found = 0;
+    const char *key = "";
+    json_t *context = NULL;
+    /* The assembled keys are only needed until the value is found */
+    jsontpl_arena_mark_t mark = jsontpl_arena_mark(&s->arena);
+
+    for (i = 0; i < name->count; i++) {
+        verify_call(component_key(s, &name->components[i], &key));
+        lookup(s, context, key, value, &found);
+
+        if (i + 1 == name->count) break;
+
+        /* Every component but the last must be an object in the context.
+           That object then becomes the context. */
+        verify(key[0], "empty name");
+        verify(found, "unknown name %s", name->full_name->ptr);
+        verify(json_is_object(value->json), "%s: not an object", name->full_name->ptr);
+        context = value->json;
+    }
+
+    verify_return();
+}
+
+/* Return the value as JSON, so that a filter can be applied to it.  A key is
+   wrapped in a new string, which is also stored in `key_string` for the caller
+   to release. */
+static json_t *value_json(jsontpl_value_t *value, json_t **key_string)
+{
+    if (value->key) {
+        return *key_string = json_string(value->key);
+    }
+    return value->json;
+}
+
+#undef verify_cleanup
+#define verify_cleanup json_decref(key_string)
+/**
+ * Look up the value that the name identifies, applying its filters if it has
+ * any, and store it in `value`, which must be released with value_release.
+ */
+static int resolve_name(
+        jsontpl_state_t *s,
+        jsontpl_name_t *name,
+        jsontpl_value_t *value)
+{
+    json_t *key_string = NULL;
+    json_t *unfiltered;
+
+    verify_call(lookup_name(s, name, value));
+
+    if (name->filters.count) {
+        verify(value->json || value->key, "unknown name %s", name->full_name->ptr);
+        unfiltered = value_json(value, &key_string);
+        value->json = NULL;
+        value->key = NULL;
+        verify_call(jsontpl_chain_apply(&name->filters, unfiltered, &s->scratch,
+            &value->json));
+        value->owned = 1;
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Set `truthy` to 1 if the value exists and is true, nonzero, or non-empty.
+ */
+static int value_truthy(jsontpl_value_t *value, char *truthy)
+{
+    json_t *obj = value->json;
+
+    *truthy = 0;
+
+    if (value->key) {
+        *truthy = value->key[0] != '\0';
+        verify_return();
+    }
+
+    if (obj == NULL) {
+        verify_return();
+    }
+
+    switch (json_typeof(obj)) {
+
+        case JSON_NULL:
+        case JSON_FALSE:
+            break;
+
+        case JSON_TRUE:
+            *truthy = 1;
+            break;
+
+        case JSON_REAL:
+            *truthy = json_real_value(obj) != 0;
+            break;
+
+        case JSON_INTEGER:
+            *truthy = json_integer_value(obj) != 0;
+            break;
+
+        case JSON_STRING:
+            *truthy = json_string_value(obj)[0] != '\0';
+            break;
+
+        case JSON_ARRAY:
+            *truthy = json_array_size(obj) != 0;
+            break;
+
+        case JSON_OBJECT:
+            *truthy = json_object_size(obj) != 0;
+            break;
+
+        default:
+            verify_fail("internal error: unknown JSON type");
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup json_decref(key_string)
+/**
+ * Write the value of the instruction's name to the output.  The last filter
+ * is applied as the value is written, so its result never becomes a JSON
+ * value.
+ */
+static int render_value(jsontpl_state_t *s, jsontpl_op_t *op)
+{
+    jsontpl_value_t value = {NULL, NULL, 0};
+    json_t *key_string = NULL;
+
+    verify_call(lookup_name(s, op->name, &value));
+
+    if (op->name->filters.count) {
+        verify(value.json || value.key, "unknown name %s", op->name->full_name->ptr);
+        verify_call(jsontpl_chain_write(&op->name->filters,
+            value_json(&value, &key_string), &s->scratch, s->out));
+    } else if (value.key) {
+        output_append(s->out, value.key);
+    } else {
+        verify_json_not_null(value.json, op->name->full_name);
+        verify_call(stringify_json(value.json, op->name->full_name, s->out));
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup value_release(&value)
+/**
+ * Render the if block's body if its name's value is truthy, or its else
+ * branch (which may be empty) otherwise.
+ */
+static int render_if(jsontpl_state_t *s, size_t index)
+{
+    char truthy;
+    jsontpl_op_t *op = &s->program->ops[index];
+    jsontpl_value_t value = {NULL, NULL, 0};
+
+    verify_call(resolve_name(s, op->name, &value));
+    verify_call(value_truthy(&value, &truthy));
+
+    if (truthy) {
+        verify_call(render_ops(s, index + 1, op->else_op));
+    } else {
+        verify_call(render_ops(s, op->else_op, op->end_op));
+    }
+
+    verify_return();
+}
+
+/**
+ * One wave of a parallel foreach block: `chunks` chunks of the array starting
+ * at item `first`, each rendered into its own buffer with its own status.
+ */
+typedef struct {
+    jsontpl_state_t *parent;
+    size_t index;
+    json_t *array;
+    size_t first;
+    size_t chunks;
+    autostr_t **buffers;
+    int *status;
+} jsontpl_wave_t;
+
+/**
+ * Render one chunk of a wave.  This runs on a pool thread with a state of its
+ * own, starting from a copy of the parent's loop variables.  A failure
+ * cancels the chunks after this one.
+ */
+static int render_chunk(void *arg, size_t chunk)
+{
+    jsontpl_wave_t *wave = arg;
+    jsontpl_state_t *parent = wave->parent;
+    jsontpl_op_t *op = &parent->program->ops[wave->index];
+    char arena_buffer[JSONTPL_RENDER_ARENA];
+    jsontpl_state_t s = {.program = parent->program, .root = parent->root};
+    size_t i, value_binding,
+           start = wave->first + chunk * JSONTPL_PARALLEL_CHUNK,
+           end = start + JSONTPL_PARALLEL_CHUNK;
+    int status = 0;
+
+    if (end > json_array_size(wave->array)) {
+        end = json_array_size(wave->array);
+    }
+
+    jsontpl_arena_init(&s.arena, arena_buffer, sizeof(arena_buffer));
+    autostr_clear(wave->buffers[chunk]);
+    s.out = output_str(wave->buffers[chunk]);
+
+    /* A top-level block has no loop variables to copy */
+    if (parent->bindings_len) {
+        s.bindings_size = s.bindings_len = parent->bindings_len;
+        s.bindings = jsontpl_arena_alloc(&s.arena,
+            s.bindings_size * sizeof(jsontpl_binding_t));
+        memcpy(s.bindings, parent->bindings,
+            s.bindings_len * sizeof(jsontpl_binding_t));
+    }
+    value_binding = binding_push(&s, autostr_value(op->value));
+
+    for (i = start; i < end && !status; i++) {
+        s.bindings[value_binding].value.json = json_array_get(wave->array, i);
+        status = render_ops(&s, wave->index + 1, op->end_op);
+    }
+
+    wave->status[chunk] = status;
+    output_detach(&s.out);
+    jsontpl_arena_free(&s.arena);
+    jsontpl_scratch_free(&s.scratch);
+    return status;
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    for (i = 0; i < wave_size; i++) {                                       \
+        autostr_free(&buffers[i]);                                          \
+    }                                                                       \
+    free(buffers);                                                          \
+    free(status);                                                           \
+} while (0)
+/**
+ * Render the foreach block's body for each item in the array on the pool's
+ * threads, a wave of chunks at a time, and write each chunk's output in
+ * order.  If a chunk fails, the output up to the failure is written as it
+ * would have been by a serial render.
+ */
+static int render_foreach_parallel(jsontpl_state_t *s, size_t index, json_t *array)
+{
+    size_t i, chunk,
+           size = json_array_size(array),
+           wave_size = jsontpl_pool_size(s->parallel->pool) * JSONTPL_PARALLEL_WAVE;
+    autostr_t **buffers = malloc(wave_size * sizeof(autostr_t *));
+    int *status = malloc(wave_size * sizeof(int));
+    jsontpl_wave_t wave = {s, index, array, 0, 0, buffers, status};
+
+    for (i = 0; i < wave_size; i++) {
+        buffers[i] = autostr();
+        status[i] = 0;
+    }
+
+    for (wave.first = 0; wave.first < size;
+            wave.first += wave.chunks * JSONTPL_PARALLEL_CHUNK) {
+        wave.chunks = (size - wave.first + JSONTPL_PARALLEL_CHUNK - 1) /
+            JSONTPL_PARALLEL_CHUNK;
+        if (wave.chunks > wave_size) wave.chunks = wave_size;
+
+        jsontpl_pool_run(s->parallel->pool, wave.chunks, render_chunk, &wave);
+
+        for (chunk = 0; chunk < wave.chunks; chunk++) {
+            output_write(s->out, autostr_value(buffers[chunk]),
+                autostr_len(buffers[chunk]));
+            verify_call(status[chunk]);
+        }
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    value_release(&value);                                                  \
+    s->bindings_len = bindings_len;                                         \
+} while (0)
+/**
+ * Render the foreach block's body once for each value in the array, or each
+ * key/value pair in the object, binding the block's identifiers as loop
+ * variables for the duration of the block.
+ */
+static int render_foreach(jsontpl_state_t *s, size_t index)
+{
+    jsontpl_op_t *op = &s->program->ops[index];
+    jsontpl_value_t value = {NULL, NULL, 0};
+    size_t bindings_len = s->bindings_len;
+    size_t key_binding, value_binding;
+    // Borrowed references; no need to free during cleanup
+    size_t array_index;
+    json_t *array_value;
+    const char *object_key;
+    json_t *object_value;
+
+    verify_call(resolve_name(s, op->name, &value));
+    verify(value.json || value.key, "%s: no such item", op->name->full_name->ptr);
+
+    if (json_is_array(value.json)) {
+        verify(op->key == NULL, "foreach block over an array takes only a value identifier");
+
+        if (s->parallel && s->parallel->pool &&
+                json_array_size(value.json) >= s->parallel->min_items) {
+            verify_call(render_foreach_parallel(s, index, value.json));
+            verify_return();
+        }
+
+        value_binding = binding_push(s, autostr_value(op->value));
+
+        json_array_foreach(value.json, array_index, array_value) {
+            s->bindings[value_binding].value.json = array_value;
+            verify_call(render_ops(s, index + 1, op->end_op));
+        }
+
+    } else if (json_is_object(value.json)) {
+        verify(op->key != NULL, "foreach block over an object requires a key and a value identifier");
+        key_binding = binding_push(s, autostr_value(op->key));
+        value_binding = binding_push(s, autostr_value(op->value));
+
+        json_object_foreach(value.json, object_key, object_value) {
+            s->bindings[key_binding].value.key = object_key;
+            s->bindings[value_binding].value.json = object_value;
+            verify_call(render_ops(s, index + 1, op->end_op));
+        }
+
+    } else {
+        verify_fail("foreach block requires an object or array");
+    }
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+static int render_ops(jsontpl_state_t *s, size_t start, size_t end)
+{
+    size_t index = start;
+    jsontpl_program_t *p = s->program;
+    jsontpl_op_t *op;
+
+    while (index < end) {
+        op = &p->ops[index];
+
+        switch (op->code) {
+
+            case OP_TEXT:
+                output_write(s->out, op->text, op->text_len);
+                index++;
+                break;
+
+            case OP_VALUE:
+                verify_call_hint(render_value(s, op),
+                    JSONTPL_VALUE_HINT, cursor_line_at(p->source, op->offset),
+                    cursor_column_at(p->source, op->offset));
+                index++;
+                break;
+
+            case OP_IF:
+                verify_call_hint(render_if(s, index),
+                    JSONTPL_BLOCK_HINT, "if", cursor_line_at(p->source, op->offset),
+                    cursor_column_at(p->source, op->offset));
+                index = op->end_op;
+                break;
+
+            case OP_FOREACH:
+                verify_call_hint(render_foreach(s, index),
+                    JSONTPL_BLOCK_HINT, "foreach", cursor_line_at(p->source, op->offset),
+                    cursor_column_at(p->source, op->offset));
+                index = op->end_op;
+                break;
+
+            default:
+                verify_fail("internal error: unknown instruction");
+        }
+    }
+
+    verify_return();
+}
+
+
+/* Public functions: */
+
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_arena_free(&s.arena);                                           \
+    jsontpl_scratch_free(&s.scratch);                                       \
+} while (0)
+int jsontpl_render_program(
+        jsontpl_program_t *program,
+        const jsontpl_parallel_t *parallel,
+        json_t *root,
+        output_t *out)
+{
+    char arena_buffer[JSONTPL_RENDER_ARENA];
+    jsontpl_state_t s = {.program = program, .parallel = parallel, .root = root,
+        .out = out};
+
+    jsontpl_arena_init(&s.arena, arena_buffer, sizeof(arena_buffer));
+    verify_call(render_ops(&s, 0, program->len));
+    verify_return();
+}
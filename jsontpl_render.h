@@ -0,0 +1,34 @@
+#ifndef JSONTPL_RENDER_H
+#define JSONTPL_RENDER_H
+
+#include <stdio.h>
+#include <jansson.h>
+
+#include "autostr.h"
+#include "jsontpl.h"
+#include "jsontpl_compile.h"
+#include "output.h"
+
+/**
+ * When to render foreach blocks in parallel: those over arrays of at least
+ * `min_items` items are split between the threads of `pool`, unless it's
+ * NULL.
+ */
+typedef struct {
+    jsontpl_pool_t *pool;
+    size_t min_items;
+} jsontpl_parallel_t;
+
+/**
+ * Render a compiled program against the JSON object `root` and write the
+ * result to `out`.  Name lookups and filters are evaluated here; syntax errors
+ * have already been reported by jsontpl_compile_program.  `root` is not
+ * modified.  `parallel` may be NULL to render everything on this thread.
+ */
+int jsontpl_render_program(
+        jsontpl_program_t *program,
+        const jsontpl_parallel_t *parallel,
+        json_t *root,
+        output_t *out);
+
+#endif // JSONTPL_RENDER_H
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "jsontpl_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define JSONTPL_SCAN_X86 1
+#include <immintrin.h>
+#else
+#define JSONTPL_SCAN_X86 0
+#endif
+
+#if JSONTPL_SCAN_X86
+
+/* The vector scanners only use aligned loads, and never load a block that
+   starts at or after the end of the text.  An aligned load never crosses a
+   page boundary, so reading the rest of the last block is safe even when the
+   text is a memory-mapped file, but it is still outside the text as far as
+   AddressSanitizer and ThreadSanitizer are concerned. */
+#define JSONTPL_SCAN_NO_SANITIZE \
+    __attribute__((no_sanitize_address, no_sanitize_thread))
+
+/* Matches in the last block may lie past the end of the text. */
+#define scan_clamp(span, len) ((size_t)(span) < (len) ? (size_t)(span) : (len))
+
+JSONTPL_SCAN_NO_SANITIZE
+static size_t scan_literal_sse2(const char *text, size_t len)
+{
+    const __m128i brace = _mm_set1_epi8('{'),
+                  backslash = _mm_set1_epi8('\\'),
+                  nul = _mm_setzero_si128();
+    const char *block = (const char *)((uintptr_t)text & ~(uintptr_t)15);
+    __m128i chunk;
+    unsigned int mask;
+
+    chunk = _mm_load_si128((const __m128i *)block);
+    mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, brace), _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(chunk, nul)));
+    /* Ignore matches before the start of the text. */
+    mask >>= text - block;
+    if (mask) {
+        return scan_clamp(__builtin_ctz(mask), len);
+    }
+
+    for (;;) {
+        block += 16;
+        if (block >= text + len) {
+            return len;
+        }
+        chunk = _mm_load_si128((const __m128i *)block);
+        mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, brace), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(chunk, nul)));
+        if (mask) {
+            return scan_clamp((block - text) + __builtin_ctz(mask), len);
+        }
+    }
+}
+
+JSONTPL_SCAN_NO_SANITIZE __attribute__((target("avx2")))
+static size_t scan_literal_avx2(const char *text, size_t len)
+{
+    const __m256i brace = _mm256_set1_epi8('{'),
+                  backslash = _mm256_set1_epi8('\\'),
+                  nul = _mm256_setzero_si256();
+    const char *block = (const char *)((uintptr_t)text & ~(uintptr_t)31);
+    __m256i chunk;
+    unsigned int mask;
+
+    chunk = _mm256_load_si256((const __m256i *)block);
+    mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, brace), _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(chunk, nul)));
+    /* Ignore matches before the start of the text. */
+    mask >>= text - block;
+    if (mask) {
+        return scan_clamp(__builtin_ctz(mask), len);
+    }
+
+    for (;;) {
+        block += 32;
+        if (block >= text + len) {
+            return len;
+        }
+        chunk = _mm256_load_si256((const __m256i *)block);
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, brace), _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(chunk, nul)));
+        if (mask) {
+            return scan_clamp((block - text) + __builtin_ctz(mask), len);
+        }
+    }
+}
+
+#else // JSONTPL_SCAN_X86
+
+static size_t scan_literal_portable(const char *text, size_t len)
+{
+    const char *end = text;
+
+    while (end < text + len && *end != '\0' && *end != '{' && *end != '\\') {
+        end++;
+    }
+
+    return end - text;
+}
+
+#endif // JSONTPL_SCAN_X86
+
+
+/* Public functions: */
+
+
+size_t jsontpl_scan_literal(const char *text, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+#if JSONTPL_SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_literal_avx2(text, len);
+    }
+    return scan_literal_sse2(text, len);
+#else // JSONTPL_SCAN_X86
+    return scan_literal_portable(text, len);
+#endif // JSONTPL_SCAN_X86
+}
@@ -0,0 +1,15 @@
+#ifndef JSONTPL_SCAN_H
+#define JSONTPL_SCAN_H
+
+#include <stdlib.h>
+
+/**
+ * Return the number of characters at the start of the `len` bytes of `text`
+ * before the first '{', '\\' or NUL, i.e. the length of the run of plain
+ * literal text, or `len` if there is none.  On x86 this compares 16 or 32
+ * characters at a time using SSE2 or AVX2, whichever the CPU supports; other
+ * platforms use a portable loop.
+ */
+size_t jsontpl_scan_literal(const char *text, size_t len);
+
+#endif // JSONTPL_SCAN_H
@@ -0,0 +1,485 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif // _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#include <jansson.h>
+
+#include "autostr.h"
+#include "jsontpl.h"
+#include "jsontpl_pool.h"
+#include "jsontpl_server.h"
+#include "verify.h"
+
+#ifndef _WIN32
+
+/* Status of a request that couldn't be parsed. */
+#define SERVER_ERROR_REQUEST 1
+
+typedef struct {
+    const char *template_dir;
+    int listener;
+    jsontpl_cache_t *cache;
+    // Guards the counters and latencies
+    pthread_mutex_t lock;
+    unsigned long requests;
+    unsigned long errors;
+    // The latencies of the last JSONTPL_SERVER_WINDOW requests, in seconds
+    size_t latencies_len;
+    size_t latencies_next;
+    double latencies[JSONTPL_SERVER_WINDOW];
+} server_t;
+
+/**
+ * A client connection, served by one thread.  The path and payload buffers
+ * are reused from one request to the next.
+ */
+typedef struct {
+    server_t *server;
+    int fd;
+    FILE *input;
+    autostr_t *path;
+    char *payload;
+    size_t payload_size;
+} connection_t;
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static const char *status_reason(int status)
+{
+    switch (status) {
+        case SERVER_ERROR_REQUEST: return "malformed request";
+        case JSONTPL_ERROR_LOAD: return "load failed";
+        case JSONTPL_ERROR_COMPILE: return "compile failed";
+        case JSONTPL_ERROR_RENDER: return "render failed";
+        default: return "failed";
+    }
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Write the header and body to the client, retrying until all of it is sent.
+ */
+static int send_reply(
+        connection_t *conn,
+        const char *header,
+        const char *body,
+        size_t len)
+{
+    struct iovec iov[2];
+    ssize_t written;
+    int i;
+
+    iov[0].iov_base = (char *)header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = (char *)body;
+    iov[1].iov_len = len;
+
+    while (iov[0].iov_len + iov[1].iov_len) {
+        written = writev(conn->fd, iov, 2);
+        if (written < 0 && errno == EINTR) continue;
+        verify(written >= 0, "error writing reply: %s", strerror(errno));
+        for (i = 0; i < 2; i++) {
+            if ((size_t)written >= iov[i].iov_len) {
+                written -= iov[i].iov_len;
+                iov[i].iov_len = 0;
+            } else {
+                iov[i].iov_base = (char *)iov[i].iov_base + written;
+                iov[i].iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+
+    verify_return();
+}
+
+static int send_ok(connection_t *conn, const char *body, size_t len)
+{
+    char header[32];
+
+    sprintf(header, "OK %lu\n", (unsigned long)len);
+    return send_reply(conn, header, body, len);
+}
+
+static int send_error(connection_t *conn, int status)
+{
+    char header[64];
+
+    sprintf(header, "ERROR %d %s\n", status, status_reason(status));
+    return send_reply(conn, header, NULL, 0);
+}
+
+/* Count a request and the time it took since `start`. */
+static void server_record(server_t *server, double start, int status)
+{
+    double latency = seconds() - start;
+
+    pthread_mutex_lock(&server->lock);
+    server->requests++;
+    if (status) server->errors++;
+    server->latencies[server->latencies_next] = latency;
+    server->latencies_next = (server->latencies_next + 1) % JSONTPL_SERVER_WINDOW;
+    if (server->latencies_len < JSONTPL_SERVER_WINDOW) server->latencies_len++;
+    pthread_mutex_unlock(&server->lock);
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/**
+ * Assemble the path of the template file that the id names, making sure it
+ * stays under the template directory.
+ */
+static int template_path(connection_t *conn, const char *id)
+{
+    const char *component;
+    size_t len;
+
+    verify(*id && *id != '/', "invalid template id %s", id);
+    for (component = id; *component; component += len + (component[len] == '/')) {
+        len = strcspn(component, "/");
+        verify(!(len == 2 && component[0] == '.' && component[1] == '.'),
+            "invalid template id %s", id);
+    }
+
+    autostr_append(autostr_clear(conn->path), conn->server->template_dir);
+    autostr_append(autostr_append(conn->path, "/"), id);
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    json_decref(root);                                                      \
+    free(output);                                                           \
+    jsontpl_cache_release(conn->server->cache, &cached);                    \
+} while (0)
+/**
+ * Render the template against the payload, returning a JSONTPL_ERROR_* code
+ * if that fails.
+ */
+static int render_payload(
+        connection_t *conn,
+        const char *id,
+        size_t len,
+        char **reply,
+        size_t *reply_len)
+{
+    int status;
+    char *output = NULL;
+    json_t *root = NULL;
+    jsontpl_cached_t *cached = NULL;
+    jsontpl_template_t *tpl;
+
+    verify_call_code(template_path(conn, id), JSONTPL_ERROR_LOAD);
+    status = jsontpl_cache_get(conn->server->cache, autostr_value(conn->path), &cached);
+    verify_call_code(status, status);
+    tpl = jsontpl_cached_template(cached);
+
+    status = jsontpl_template_parse_json(tpl, conn->payload, len, &root);
+    verify_call_code(status, status);
+    status = jsontpl_template_render_string(tpl, root, &output, reply_len);
+    verify_call_code(status, status);
+
+    *reply = output;
+    output = NULL;
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    free(latencies);                                                        \
+    json_decref(stats);                                                     \
+    free(body);                                                             \
+} while (0)
+static int send_stats(connection_t *conn)
+{
+    server_t *server = conn->server;
+    size_t n;
+    double *latencies = malloc(JSONTPL_SERVER_WINDOW * sizeof(double));
+    unsigned long requests, errors, served;
+    jsontpl_cache_stats_t cache;
+    json_t *stats = NULL;
+    char *body = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    requests = server->requests;
+    errors = server->errors;
+    n = server->latencies_len;
+    memcpy(latencies, server->latencies, n * sizeof(double));
+    pthread_mutex_unlock(&server->lock);
+    jsontpl_cache_stats(server->cache, &cache);
+
+    qsort(latencies, n, sizeof(double), compare_double);
+    if (n == 0) latencies[0] = 0;
+    served = cache.hits + cache.misses + cache.reloads;
+
+    stats = json_pack("{s:I, s:I, s:{s:I, s:I, s:I, s:I, s:I, s:f}, "
+        "s:{s:I, s:f, s:f, s:f, s:f}}",
+        "requests", (json_int_t)requests,
+        "errors", (json_int_t)errors,
+        "cache",
+            "hits", (json_int_t)cache.hits,
+            "misses", (json_int_t)cache.misses,
+            "reloads", (json_int_t)cache.reloads,
+            "evictions", (json_int_t)cache.evictions,
+            "bytes", (json_int_t)cache.bytes,
+            "hit_rate", served ? (double)cache.hits / served : 0.0,
+        "latency_ms",
+            "window", (json_int_t)n,
+            "p50", latencies[n ? (n - 1) / 2 : 0] * 1000,
+            "p90", latencies[n ? (n - 1) * 9 / 10 : 0] * 1000,
+            "p99", latencies[n ? (n - 1) * 99 / 100 : 0] * 1000,
+            "max", latencies[n ? n - 1 : 0] * 1000);
+    verify(stats, "error building stats");
+    body = json_dumps(stats, JSON_PRESERVE_ORDER);
+    verify_call(send_ok(conn, body, strlen(body)));
+
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup free(output)
+/**
+ * Read and answer one request.  Set `done` if the client has hung up or the
+ * connection should be closed.
+ */
+static int serve_request(connection_t *conn, char *done)
+{
+    char header[JSONTPL_SERVER_HEADER + 1], *space, *end;
+    char *output = NULL;
+    size_t len, output_len = 0;
+    int status;
+    double start;
+
+    *done = 1;
+    if (fgets(header, sizeof(header), conn->input) == NULL) verify_return();
+    start = seconds();
+
+    len = strlen(header);
+    if (len == 0 || header[len - 1] != '\n') {
+        verify_call(send_error(conn, SERVER_ERROR_REQUEST));
+        verify_fail("request header too long");
+    }
+    header[--len] = '\0';
+    if (len && header[len - 1] == '\r') header[--len] = '\0';
+
+    if (strcmp(header, "STATS") == 0) {
+        verify_call(send_stats(conn));
+        server_record(conn->server, start, 0);
+        *done = 0;
+        verify_return();
+    }
+
+    /* RENDER <template-id> <length>, where the id may contain spaces */
+    space = strrchr(header, ' ');
+    if (strncmp(header, "RENDER ", 7) != 0 || space == NULL || space < header + 7) {
+        verify_call(send_error(conn, SERVER_ERROR_REQUEST));
+        verify_fail("malformed request: %s", header);
+    }
+    *space = '\0';
+    len = strtoul(space + 1, &end, 10);
+    if (*end || end == space + 1 || len > JSONTPL_SERVER_MAX_PAYLOAD) {
+        verify_call(send_error(conn, SERVER_ERROR_REQUEST));
+        verify_fail("malformed request length: %s", space + 1);
+    }
+
+    if (conn->payload_size < len + 1) {
+        conn->payload_size = len + 1;
+        conn->payload = realloc(conn->payload, conn->payload_size);
+    }
+    verify(fread(conn->payload, 1, len, conn->input) == len, "request payload cut short");
+
+    status = render_payload(conn, header + 7, len, &output, &output_len);
+    if (status) {
+        verify_call(send_error(conn, status));
+    } else {
+        verify_call(send_ok(conn, output, output_len));
+    }
+    server_record(conn->server, start, status);
+    *done = 0;
+
+    verify_return();
+}
+
+static void serve_connection(server_t *server, int fd)
+{
+    char done = 0;
+    connection_t conn = {server, fd, NULL, NULL, NULL, 0};
+    struct timeval idle = {JSONTPL_SERVER_IDLE_TIMEOUT, 0};
+
+    /* A client that stalls gives its thread back once a read or write has
+       waited this long, failing the request and closing the connection */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+
+    conn.input = fdopen(fd, "rb");
+    if (conn.input == NULL) {
+        close(fd);
+        return;
+    }
+    conn.path = autostr();
+
+    while (!done) {
+        if (serve_request(&conn, &done)) break;
+    }
+
+    fclose(conn.input);
+    autostr_free(&conn.path);
+    free(conn.payload);
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/* Pool task: accept connections and serve them, one at a time, for good. */
+static int serve_task(void *arg, size_t index)
+{
+    server_t *server = arg;
+    struct timespec pause = {0, 10000000};
+    int fd;
+
+    (void)index;
+    for (;;) {
+        fd = accept(server->listener, NULL, NULL);
+        if (fd >= 0) {
+            serve_connection(server, fd);
+        } else if (errno == EMFILE || errno == ENFILE ||
+                errno == ENOBUFS || errno == ENOMEM) {
+            /* Out of resources: give the other connections time to finish */
+            nanosleep(&pause, NULL);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            verify_fail("accepting a connection failed: %s", strerror(errno));
+        }
+    }
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    if (fd >= 0) close(fd);                                                 \
+} while (0)
+/**
+ * Create the listening socket.  A socket file left behind by a server that
+ * has gone away is replaced, but one that a server is listening on isn't.
+ */
+static int server_listen(const char *socket_path, int *listener)
+{
+    int fd = -1;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    verify(strlen(socket_path) < sizeof(addr.sun_path), "%s: socket path too long",
+        socket_path);
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    verify(fd >= 0, "error creating socket: %s", strerror(errno));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        verify_fail("%s: another server is listening", socket_path);
+    }
+    if (errno == ECONNREFUSED) unlink(socket_path);
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    verify(fd >= 0, "error creating socket: %s", strerror(errno));
+    verify(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+        "%s: can't bind socket: %s", socket_path, strerror(errno));
+    verify(listen(fd, SOMAXCONN) == 0, "%s: can't listen: %s", socket_path,
+        strerror(errno));
+
+    *listener = fd;
+    fd = -1;
+
+    verify_return();
+}
+
+#endif // _WIN32
+
+
+/* Public functions: */
+
+
+#ifndef _WIN32
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    if (server->listener >= 0) {                                            \
+        close(server->listener);                                            \
+        unlink(socket_path);                                                \
+    }                                                                       \
+    jsontpl_cache_free(&server->cache);                                     \
+    pthread_mutex_destroy(&server->lock);                                   \
+    free(server);                                                           \
+} while (0)
+int jsontpl_serve(
+        jsontpl_pool_t *pool,
+        const char *socket_path,
+        const char *template_dir,
+        size_t cache_budget)
+{
+    struct sigaction ignore;
+    server_t *server = calloc(1, sizeof(server_t));
+
+    server->template_dir = template_dir;
+    server->listener = -1;
+    server->cache = jsontpl_cache_new(NULL);
+    jsontpl_cache_set_budget(server->cache, cache_budget);
+    pthread_mutex_init(&server->lock, NULL);
+
+    /* A client hanging up mid-reply is an error for that connection only */
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, NULL);
+
+    verify_call_code(server_listen(socket_path, &server->listener), JSONTPL_ERROR_LOAD);
+    jsontpl_pool_run(pool, jsontpl_pool_size(pool), serve_task, server);
+
+    /* The tasks only return once accepting connections has failed */
+    verify_log_("ERROR: %s: server stopped\n", socket_path);
+    verify_cleanup;
+    return JSONTPL_ERROR_LOAD;
+}
+
+#else // _WIN32
+
+#undef verify_cleanup
+#define verify_cleanup
+int jsontpl_serve(
+        jsontpl_pool_t *pool,
+        const char *socket_path,
+        const char *template_dir,
+        size_t cache_budget)
+{
+    verify_fail("Unix domain sockets aren't supported on Windows");
+}
+
+#endif // _WIN32
@@ -0,0 +1,57 @@
+#ifndef JSONTPL_SERVER_H
+#define JSONTPL_SERVER_H
+
+#include <stdlib.h>
+
+#include "jsontpl.h"
+
+/**
+ * Longest request header line, including the template id.
+ */
+#define JSONTPL_SERVER_HEADER 4096
+
+/**
+ * Largest JSON payload a request may carry.
+ */
+#define JSONTPL_SERVER_MAX_PAYLOAD (64 * 1024 * 1024)
+
+/**
+ * Seconds a connection may go without sending or accepting data before it is
+ * closed.
+ */
+#define JSONTPL_SERVER_IDLE_TIMEOUT 30
+
+/**
+ * Number of recent requests whose latencies the percentiles are taken over.
+ */
+#define JSONTPL_SERVER_WINDOW 4096
+
+/**
+ * Listen on the Unix domain socket at `socket_path` and serve requests to
+ * render the templates under `template_dir`, with each of the pool's threads
+ * serving one connection at a time.  Each connection carries any number of
+ * requests, one after another:
+ *
+ *     RENDER <template-id> <length>\n<length bytes of JSON>
+ *     STATS\n
+ *
+ * The template id is a path relative to `template_dir` and can't leave it.
+ * Templates are compiled on first use and whenever their files change, and
+ * kept within `cache_budget` bytes (see jsontpl_cache_set_budget).  A
+ * successful request is answered with "OK <length>\n" and that many bytes:
+ * the rendered output, or a JSON object of counters for STATS.  A failed one
+ * is answered with "ERROR <code> <reason>\n", where the code is one of the
+ * JSONTPL_ERROR_* codes, or 1 for a malformed request; the connection is
+ * closed after a malformed request.  Since each thread serves one connection
+ * at a time, a connection that stays idle for JSONTPL_SERVER_IDLE_TIMEOUT
+ * seconds, between requests or in the middle of one, is closed so that idle
+ * clients can't hold every thread.  Only returns if the socket can't be set
+ * up or accepting connections fails.
+ */
+int jsontpl_serve(
+        jsontpl_pool_t *pool,
+        const char *socket_path,
+        const char *template_dir,
+        size_t cache_budget);
+
+#endif // JSONTPL_SERVER_H
@@ -1,3 +1,8 @@
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <jansson.h>
 
 #include "autostr.h"
@@ -10,21 +15,93 @@ int jsontpl_toidentifier(int c)
     return isident(c) ? c : '_';
 }
 
-#undef verify_cleanup
-#define verify_cleanup
-int valid_name(json_t *context, autostr_t *name, autostr_t *full_name)
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+size_t jsontpl_format_integer(json_int_t value, char *buffer)
 {
-    verify(name->len, "empty name");
-    verify(json_object_get(context, name->ptr) != NULL,
-        "unknown name %s", full_name->ptr);
-    verify_return();
+    char digits[JSONTPL_NUMBER_SIZE];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    unsigned long long n = value < 0 ?
+        0ULL - (unsigned long long)value : (unsigned long long)value;
+
+    /* Two digits per division */
+    while (n >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[(n % 100) * 2], 2);
+        n /= 100;
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[n * 2], 2);
+    } else {
+        *--p = '0' + (char)n;
+    }
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    memcpy(buffer, p, end - p);
+    buffer[end - p] = '\0';
+    return end - p;
+}
+
+size_t jsontpl_format_real(double value, char *buffer)
+{
+    size_t len;
+    char point;
+    char *p, *exponent, *digits;
+
+    /* Integral values below 10^17 print as plain digits in %.17g, which the
+       integer formatter produces much faster than snprintf. */
+    if (value > -1e17 && value < 1e17 && value == (double)(json_int_t)value) {
+        if (value == 0 && signbit(value)) {
+            len = 2;
+            memcpy(buffer, "-0", 2);
+        } else {
+            len = jsontpl_format_integer((json_int_t)value, buffer);
+        }
+        memcpy(buffer + len, ".0", 3);
+        return len + 2;
+    }
+
+    len = snprintf(buffer, JSONTPL_NUMBER_SIZE, "%.17g", value);
+
+    point = localeconv()->decimal_point[0];
+    if (point != '.' && (p = strchr(buffer, point)) != NULL) {
+        *p = '.';
+    }
+
+    exponent = strchr(buffer, 'e');
+    if (exponent == NULL) {
+        if (strchr(buffer, '.') == NULL) {
+            memcpy(buffer + len, ".0", 3);
+            len += 2;
+        }
+        return len;
+    }
+
+    /* e+05 becomes e5 and e-05 becomes e-5 */
+    p = exponent + 1;
+    if (*p == '-') p++;
+    digits = (*p == '+') ? p + 1 : p;
+    while (*digits == '0' && digits[1] != '\0') digits++;
+    if (digits != p) {
+        memmove(p, digits, buffer + len + 1 - digits);
+        len -= digits - p;
+    }
+
+    return len;
 }
 
 #undef verify_cleanup
 #define verify_cleanup
 int stringify_json(json_t *value, autostr_t *full_name, output_t *output)
 {
-    char *number;
+    char number[JSONTPL_NUMBER_SIZE];
     
     switch (json_typeof(value)) {
         
@@ -45,15 +122,98 @@ int stringify_json(json_t *value, autostr_t *full_name, output_t *output)
             break;
         
         case JSON_INTEGER:
+            output_write(output, number,
+                jsontpl_format_integer(json_integer_value(value), number));
+            break;
+        
         case JSON_REAL:
-            number = json_dumps(value, JSON_ENCODE_ANY);
-            output_append(output, number);
-            free(number);
+            output_write(output, number,
+                jsontpl_format_real(json_real_value(value), number));
             break;
         
         default:
             verify_fail("cannot stringify %s", full_name->ptr);
     }
     
+    verify_return();
+}
+
+void encode_string(const char *str, output_t *output)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char escape[6] = {'\\', 'u', '0', '0', '0', '0'};
+    const char *run = str;
+    unsigned char ch;
+
+    output_push(output, '"');
+    for (; *str; str++) {
+        ch = *str;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+
+        output_write(output, run, str - run);
+        run = str + 1;
+        switch (ch) {
+            case '"':  output_write(output, "\\\"", 2); break;
+            case '\\': output_write(output, "\\\\", 2); break;
+            case '\b': output_write(output, "\\b", 2); break;
+            case '\f': output_write(output, "\\f", 2); break;
+            case '\n': output_write(output, "\\n", 2); break;
+            case '\r': output_write(output, "\\r", 2); break;
+            case '\t': output_write(output, "\\t", 2); break;
+            default:
+                escape[4] = hex[ch >> 4];
+                escape[5] = hex[ch & 0xf];
+                output_write(output, escape, 6);
+        }
+    }
+    output_write(output, run, str - run);
+    output_push(output, '"');
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+int encode_json(json_t *value, output_t *output)
+{
+    size_t array_index;
+    json_t *array_value;
+    const char *object_key;
+    json_t *object_value;
+    char first = 1;
+
+    switch (json_typeof(value)) {
+
+        case JSON_STRING:
+            encode_string(json_string_value(value), output);
+            break;
+
+        case JSON_ARRAY:
+            output_push(output, '[');
+            json_array_foreach(value, array_index, array_value) {
+                if (array_index) {
+                    output_write(output, ", ", 2);
+                }
+                verify_call(encode_json(array_value, output));
+            }
+            output_push(output, ']');
+            break;
+
+        case JSON_OBJECT:
+            output_push(output, '{');
+            json_object_foreach(value, object_key, object_value) {
+                if (!first) {
+                    output_write(output, ", ", 2);
+                }
+                first = 0;
+                encode_string(object_key, output);
+                output_write(output, ": ", 2);
+                verify_call(encode_json(object_value, output));
+            }
+            output_push(output, '}');
+            break;
+
+        default:
+            verify_call(stringify_json(value, NULL, output));
+    }
+
     verify_return();
 }
\ No newline at end of file
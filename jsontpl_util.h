@@ -9,7 +9,11 @@
 #include "output.h"
 
 #define JSONTPL_JSON_ERROR "invalid JSON: %s (line %d, column %d)\n"
-#define JSONTPL_BLOCK_HINT "%s block at line %d, column %d"
+#define JSONTPL_BLOCK_HINT "%s block at line %zu, column %zu"
+#define JSONTPL_VALUE_HINT "value at line %zu, column %zu"
+
+/* Enough for any integer or for a double in %.17g notation, plus NUL. */
+#define JSONTPL_NUMBER_SIZE 32
 
 #define isident(c) (isalnum(c) || (c) == '_')
 #define verify_json_not_null(obj, full_name) \
@@ -18,24 +22,43 @@
 typedef enum {
     // Not inside any block. EOF is vaild here.
     SCOPE_FILE = 0x01,
-    // Inside a foreach block for a non-empty array or object.
+    // Inside a foreach block.
     SCOPE_FOREACH = 0x02,
     // Inside an if block, before the 'else' marker (if any).
     SCOPE_IF = 0x04,
     // Inside an if block, after the 'else' marker.
     SCOPE_ELSE = 0x08,
-    // Soft discard: don't check variables or write output. Combined with
-    //  SCOPE_FOREACH for empty arrays / objects and SCOPE_IF for false clauses.
-    SCOPE_DISCARD = 0x10,
-    // Force discard: combined with SCOPE_DISCARD for nested blocks to prevent
-    //  nested if-else blocks from writing output.
-    SCOPE_FORCE_DISCARD = 0x20,
 } jsontpl_scope;
 
 // This actually returns an int, as opposed to "zero or an error code"
 int jsontpl_toidentifier(int c);
 
-int valid_name(json_t *context, autostr_t *name, autostr_t *full_name);
+/**
+ * Format an integer into `buffer`, which must hold JSONTPL_NUMBER_SIZE bytes,
+ * and return its length.  The result is the same as jansson's.
+ */
+size_t jsontpl_format_integer(json_int_t value, char *buffer);
+
+/**
+ * Format a real into `buffer`, which must hold JSONTPL_NUMBER_SIZE bytes, and
+ * return its length.  The result is the same as jansson's: %.17g, with ".0"
+ * added to integral values and the exponent's sign and leading zeros dropped.
+ */
+size_t jsontpl_format_real(double value, char *buffer);
+
 int stringify_json(json_t *value, autostr_t *full_name, output_t *output);
 
+/**
+ * Write the string as a JSON string literal, escaping the same characters
+ * that jansson does.
+ */
+void encode_string(const char *str, output_t *output);
+
+/**
+ * Write the value to the output as JSON, formatted the way json_dumps formats
+ * it without flags.  Unlike json_dumps, this only reads the value, so it's
+ * safe on a document shared between threads.
+ */
+int encode_json(json_t *value, output_t *output);
+
 #endif // JSONTPL_UTIL_H
\ No newline at end of file
@@ -1,26 +1,97 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif // _WIN32
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif // _WIN32
 
 #include "autostr.h"
 #include "output.h"
+#include "verify.h"
+
+/* Write the buffered data followed by `str` straight to the file, bypassing
+   stdio.  Both go out in a single writev call unless it comes up short. */
+static void output_file_write(output_t *o, const char *str, size_t len)
+{
+#ifdef _WIN32
+    if (fwrite(o->buffer, 1, o->buffer_len, o->file) != o->buffer_len ||
+            fwrite(str, 1, len, o->file) != len) {
+        o->error = 1;
+    }
+#else // _WIN32
+    struct iovec iov[2];
+    ssize_t written;
+    int i;
+
+    iov[0].iov_base = o->buffer;
+    iov[0].iov_len = o->buffer_len;
+    iov[1].iov_base = (char *)str;
+    iov[1].iov_len = len;
+
+    /* Anything the caller wrote through stdio has to come first. */
+    if (fflush(o->file) != 0) {
+        o->error = 1;
+    }
+
+    while (!o->error && iov[0].iov_len + iov[1].iov_len) {
+        written = writev(fileno(o->file), iov, 2);
+        if (written < 0) {
+            if (errno != EINTR) o->error = 1;
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            if ((size_t)written >= iov[i].iov_len) {
+                written -= iov[i].iov_len;
+                iov[i].iov_len = 0;
+            } else {
+                iov[i].iov_base = (char *)iov[i].iov_base + written;
+                iov[i].iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+#endif // _WIN32
+
+    o->buffer_len = 0;
+}
 
 output_t *output_str(autostr_t *str)
 {
     output_t *o = malloc(sizeof(output_t));
     o->type = OUTPUT_STR;
     o->write = 1;
+    o->error = 0;
     o->str = str;
     o->file = NULL;
+    o->buffer = NULL;
+    o->buffer_size = 0;
+    o->buffer_len = 0;
     return o;
 }
 
 output_t *output_file(FILE *file)
+{
+    return output_file_buffered(file, OUTPUT_BUFFER_SIZE);
+}
+
+output_t *output_file_buffered(FILE *file, size_t buffer_size)
 {
     output_t *o = malloc(sizeof(output_t));
     o->type = OUTPUT_FILE;
     o->write = 1;
+    o->error = 0;
     o->str = NULL;
     o->file = file;
+    o->buffer_size = buffer_size ? buffer_size : 1;
+    o->buffer = malloc(o->buffer_size);
+    o->buffer_len = 0;
     return o;
 }
 
@@ -32,9 +103,23 @@ void output_free(output_t **o)
                 autostr_free(&((*o)->str));
                 break;
             case OUTPUT_FILE:
+                output_flush(*o);
                 fclose((*o)->file);
                 break;
         }
+        free((*o)->buffer);
+        free(*o);
+        *o = NULL;
+    }
+}
+
+void output_detach(output_t **o)
+{
+    if (*o) {
+        if ((*o)->type == OUTPUT_FILE) {
+            output_flush(*o);
+        }
+        free((*o)->buffer);
         free(*o);
         *o = NULL;
     }
@@ -51,27 +136,59 @@ void output_set_write(output_t *o, char write) { o->write = write; }
 void output_push(output_t *o, char ch)
 {
     if (!o->write) return;
-    
+
     switch (o->type) {
         case OUTPUT_STR:
             autostr_push(o->str, ch);
             break;
         case OUTPUT_FILE:
-            fputc(ch, o->file);
+            if (o->buffer_len == o->buffer_size) {
+                output_file_write(o, NULL, 0);
+            }
+            o->buffer[o->buffer_len++] = ch;
             break;
     }
 }
 
 void output_append(output_t *o, const char *str)
+{
+    output_write(o, str, strlen(str));
+}
+
+void output_write(output_t *o, const char *str, size_t len)
 {
     if (!o->write) return;
-    
+
     switch (o->type) {
         case OUTPUT_STR:
-            autostr_append(o->str, str);
+            autostr_append_len(o->str, str, len);
             break;
         case OUTPUT_FILE:
-            fprintf(o->file, "%s", str);
+            if (o->buffer_len + len <= o->buffer_size) {
+                memcpy(o->buffer + o->buffer_len, str, len);
+                o->buffer_len += len;
+            } else if (len < o->buffer_size) {
+                output_file_write(o, NULL, 0);
+                memcpy(o->buffer, str, len);
+                o->buffer_len = len;
+            } else {
+                /* Too big to be worth buffering */
+                output_file_write(o, str, len);
+            }
             break;
     }
-}
\ No newline at end of file
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+int output_flush(output_t *o)
+{
+    if (o->type == OUTPUT_FILE) {
+        if (o->buffer_len) {
+            output_file_write(o, NULL, 0);
+        }
+        verify(!o->error, "error writing output");
+    }
+
+    verify_return();
+}
@@ -3,32 +3,43 @@
 
 #define OUTPUT_MACROS 1
 
+/**
+ * Default size of the write buffer used by file outputs.
+ */
+#define OUTPUT_BUFFER_SIZE 65536
+
 typedef enum {
     OUTPUT_STR,
     OUTPUT_FILE,
 } output_type;
 
-typedef struct {
+typedef struct output {
     output_type type;
     char write;
+    char error;
     autostr_t *str;
     FILE *file;
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_len;
 } output_t;
 
 // Constructors / destructors:
 
 output_t *output_str(autostr_t *str);
 output_t *output_file(FILE *file);
+output_t *output_file_buffered(FILE *file, size_t buffer_size);
 void output_free(output_t **o);
+void output_detach(output_t **o);
 
 // Getters / setters:
 
 #if OUTPUT_MACROS
-#define output_get_type(o) (o->type)
-#define output_get_write(o) (o->write)
-#define output_get_str(o) (o->str)
-#define output_get_file(o) (o->file)
-#define output_set_write(o, w) (o->write = (w))
+#define output_get_type(o) ((o)->type)
+#define output_get_write(o) ((o)->write)
+#define output_get_str(o) ((o)->str)
+#define output_get_file(o) ((o)->file)
+#define output_set_write(o, w) ((o)->write = (w))
 #else // OUTPUT_MACROS
 output_type output_get_type(output_t *o);
 FILE *output_get_file(output_t *o);
@@ -41,5 +52,7 @@ void output_set_write(output_t *o, char write);
 
 void output_push(output_t *o, char ch);
 void output_append(output_t *o, const char *str);
+void output_write(output_t *o, const char *str, size_t len);
+int output_flush(output_t *o);
 
-#endif // CURSOR_H
\ No newline at end of file
+#endif // OUTPUT_H
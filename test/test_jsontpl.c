@@ -1,9 +1,12 @@
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "verify.h"
 #include "jsontpl.h"
+#include "jsontpl_compile.h"
 
 typedef struct {
     char *name;
@@ -28,6 +31,10 @@ test_case tests[] = {
         "{}",
         "\\\\ \\{% %\\} \\{= =\\} \\{\\}",
         (const char *[]){"\\ {% %} {= =} {}", NULL}
+    }, {"long literal runs",
+        "{\"a\": 1}",
+        "0123456789abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ{= a =}0123456789abcdefghijklmnopqrstuvwxyz{0123456789\\ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz\\{",
+        (const char *[]){"0123456789abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ10123456789abcdefghijklmnopqrstuvwxyz{0123456789\\ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz{", NULL}
     
     /* Values */
     
@@ -35,6 +42,10 @@ test_case tests[] = {
         "{\"alpha\": null, \"beta\": false, \"gamma\": true, \"delta\": 42, \"epsilon\": 3.125, \"zeta\": \"foobar\"}",
         "{= alpha =} {= beta =} {= gamma =} {= delta =} {= epsilon =} {= zeta =}",
         (const char *[]){"null false true 42 3.125 foobar", NULL}
+    }, {"number formatting",
+        "{\"n\": [0, -1, 9, 10, 99, 100, 1234567890123, -9223372036854775808, 9223372036854775807, 0.0, -0.0, 0.1, 100.0, -2.5, 1e100, 1.5e-7, 123456789012345678.0, 1e16, 1e17, 5e-324, 1.7976931348623157e308, 12345.678, 1e-5, 0.0001, -1e16]}",
+        "{% foreach n: x %}{= x =} {% end %}",
+        (const char *[]){"0 -1 9 10 99 100 1234567890123 -9223372036854775808 9223372036854775807 0.0 -0.0 0.10000000000000001 100.0 -2.5 1e100 1.4999999999999999e-7 1.2345678901234568e17 10000000000000000.0 1e17 4.9406564584124654e-324 1.7976931348623157e308 12345.678 1.0000000000000001e-5 0.0001 -10000000000000000.0 ", NULL}
     }, {"value spacing",
         "{\"alpha\": null, \"beta\": false, \"gamma\": true, \"delta\": 42, \"epsilon\": 3.125, \"zeta\": \"foobar\"}",
         "{= alpha=} {=beta=}{=gamma=} {=delta =} {= epsilon =} {=\tzeta\t=}",
@@ -47,6 +58,12 @@ test_case tests[] = {
         "{\"obj\": {\"alpha\": null, \"beta\": false, \"gamma\": true, \"delta\": 42}, \"names\": [\"alpha\", \"beta\", \"gamma\", \"delta\"]}",
         "{% foreach names: name %}{= obj.{name} =} {% end %}",
         (const char *[]){"null false true 42 ", NULL}
+    }, {"assembled keys and deep nesting",
+        "{\"o\": {\"k_X_y\": \"hit\"}, \"a\": \"X\", \"b\": \"Y\", \"m\": {\"p\": {\"q\": {\"r\": {\"s\": {\"t\": 2}}}}}}",
+        "{= o.k_{a}_{b|lower} =} {% foreach m: k1 -> v1 %}{% foreach v1: k2 -> v2 %}{% foreach v2: k3 -> v3 %}"
+        "{% foreach v3: k4 -> v4 %}{% foreach v4: k5 -> v5 %}{= k1 =}{= k2 =}{= k3 =}{= k4 =}{= k5 =}{= v5 =}"
+        "{= o.k_{a}_{b|lower} =}{% end %}{% end %}{% end %}{% end %}{% end %}",
+        (const char *[]){"hit pqrst2hit", NULL}
     
     /* Blocks */
     
@@ -112,6 +129,18 @@ test_case tests[] = {
         "{\"alpha\": true}",
         "({% if alpha %}Alpha{% if beta %}Beta{% else %}Alpha{% end %}{% end %} {% if beta %}Beta{% if alpha %}Alpha{% else %}Beta{% end %}{% end %})",
         (const char *[]){"(AlphaAlpha )", NULL}
+    }, {"comment block",
+        "{\"alpha\": true}",
+        "[{% comment %}{= not a name =}{% if alpha %}Alpha{% else %}Beta{% end %}{% end %}]",
+        (const char *[]){"[]", NULL}
+    }, {"comment block with nested blocks",
+        "{}",
+        "{% comment %}{% foreach x: y %}{% if z %}{= a ==}{% else %}b{% end %}{% end %}\\{% end %}{% end %}after",
+        (const char *[]){"after", NULL}
+    }, {"nested foreach in if-else",
+        "{\"alpha\": false, \"array\": [1, 2, 3]}",
+        "{% if alpha %}{% foreach array: a %}{= a =}{% end %}{% else %}{% foreach array: a %}{% foreach array: b %}{= a =}{= b =} {% end %}{% end %}{% end %}",
+        (const char *[]){"11 12 13 21 22 23 31 32 33 ", NULL}
     
     /* Filters */
     
@@ -136,10 +165,25 @@ test_case tests[] = {
         "{= empty | english =}; {= one | english =}; {= two | english =}; {= three | english =}; {= four | english =}",
         (const char *[]){"; alpha; alpha and beta; alpha, beta, and gamma; alpha, beta, gamma, and delta", NULL}
     }, {"js filter",
-        // TODO: array / object tests
         "{\"alpha\": null, \"beta\": false, \"gamma\": true, \"delta\": 42, \"epsilon\": 3.125, \"zeta\": \"foobar\"}",
         "{= alpha | js =} {= beta | js =} {= gamma | js =} {= delta | js =} {= epsilon | js =} {= zeta | js =}",
         (const char *[]){"null false true 42 3.125 \"foobar\"", NULL}
+    }, {"js filter on arrays and objects",
+        "{\"array\": [1, [], {}, [null, 2.5]], \"object\": {\"k\\\"ey\": \"a\\\\b\\n\\u0001/\", \"o\": {\"x\": [1, 2]}}}",
+        "{= array | js =} {= object | js =}",
+        (const char *[]){"[1, [], {}, [null, 2.5]] {\"k\\\"ey\": \"a\\\\b\\n\\u0001/\", \"o\": {\"x\": [1, 2]}}", NULL}
+    }, {"filters on keys and in blocks",
+        "{\"object\": {\"Ab\": [1, 2]}}",
+        "{% foreach object: k -> v %}{= k | lower =} {= k | js =} {% if v | count %}{= v | count =}{% end %}{% end %}",
+        (const char *[]){"ab \"Ab\" 2", NULL}
+    }, {"filter chains",
+        "{\"s\": \"Hello World!\", \"a\": [1, \"x\"]}",
+        "{= s | lower | identifier | c =} {= s | upper | lower =} {= a | js | upper =} {= a | count | js =} {= s | js | js =} {= s | identifier | js | upper =}",
+        (const char *[]){"\"hello_world_\" hello world! [1, \"X\"] 2 \"\\\"Hello World!\\\"\" \"HELLO_WORLD_\"", NULL}
+    }, {"filter chains in blocks",
+        "{\"s\": \"Key\", \"obj\": {\"KEY\": [1, 2]}}",
+        "{% if s | lower | identifier %}{= obj.{s | upper}| count =}{% end %}{% foreach obj.{s | upper | lower | upper}: x %}{= x | js | js =}{% end %}",
+        (const char *[]){"2\"1\"\"2\"", NULL}
     }, {"c filter",
         "{\"alpha\": null, \"beta\": false, \"gamma\": true, \"delta\": 42, \"epsilon\": 3.125, \"zeta\": \"foobar\"}",
         "{= alpha | c =} {= beta | c =} {= gamma | c =} {= delta | c =} {= epsilon | c =} {= zeta | c =}",
@@ -173,6 +217,687 @@ int run_test(const test_case *test)
         test->name, test->expected[0], output);
 }
 
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_template_free(&tpl);                                            \
+    json_decref(root);                                                      \
+    free(output);                                                           \
+} while (0)
+int run_template_test()
+{
+    const char *names[] = {"alpha", "beta", NULL};
+    const char **name;
+    char *output = NULL;
+    size_t i, length;
+    FILE *template_file;
+    json_t *root = NULL;
+    jsontpl_template_t *tpl = NULL;
+    
+    verify_call(jsontpl_template_compile("[{= name | upper =}]", &tpl));
+    
+    /* One compiled template, rendered against several roots */
+    for (name = &names[0]; *name != NULL; name++) {
+        root = json_pack("{ss}", "name", *name);
+        verify_call(jsontpl_template_render_string(tpl, root, &output, &length));
+        verify(output[0] == '[' && output[1] == toupper((*name)[0]),
+            "template test failed: %s", output);
+        verify(length == strlen(*name) + 2, "wrong length for %s", output);
+        json_decref(root);
+        root = NULL;
+        free(output);
+        output = NULL;
+    }
+    
+    /* Loop variables don't leak into the JSON input */
+    jsontpl_template_free(&tpl);
+    root = json_pack("{s[ii]}", "array", 1, 2);
+    verify_call(jsontpl_template_compile("{% foreach array: a %}{= a =}{% end %}", &tpl));
+    verify_call(jsontpl_template_render_string(tpl, root, &output, NULL));
+    verify(json_object_size(root) == 1, "root was modified");
+    json_decref(root);
+    free(output);
+    output = NULL;
+    
+    /* Each phase reports its own status code */
+    root = json_object();
+    verify(jsontpl_template_render_string(tpl, root, &output, NULL) == JSONTPL_ERROR_RENDER,
+        "expected a render error");
+    jsontpl_template_free(&tpl);
+    verify(jsontpl_template_compile("{% if %}", &tpl) == JSONTPL_ERROR_COMPILE,
+        "expected a compile error");
+    verify(jsontpl_template_compile("{% if 0 %}{= x | nonexistent =}{% end %}", &tpl)
+        == JSONTPL_ERROR_COMPILE, "expected an unknown filter to fail compilation");
+    verify(jsontpl_template_compile("{= x | count | upper =}", &tpl)
+        == JSONTPL_ERROR_COMPILE, "expected a mismatched filter chain to fail compilation");
+    verify(jsontpl_template_load("nonexistent.tpl", &tpl) == JSONTPL_ERROR_LOAD,
+        "expected a load error");
+    verify(jsontpl_string("{", "", &output) == JSONTPL_ERROR_LOAD,
+        "expected a load error");
+    
+    /* The one-shot API can return the length and skip the shrink */
+    verify_call(jsontpl_string_len("{\"name\": \"len\"}", "<{= name =}>", &output,
+        &length, 0));
+    verify(length == 5 && strcmp(output, "<len>") == 0,
+        "length test failed: %s", output);
+    free(output);
+    output = NULL;
+    
+    /* Template files are parsed in place, with no terminator after them, even
+       when they end on a page boundary. */
+    template_file = fopen("test_page.tpl", "wb");
+    verify(template_file, "couldn't write test_page.tpl");
+    for (i = 0; i < 4096 - 10; i++) fputc('-', template_file);
+    fputs("{= name =}", template_file);
+    fclose(template_file);
+    verify_call(jsontpl_template_load("test_page.tpl", &tpl));
+    remove("test_page.tpl");
+    json_decref(root);
+    root = json_pack("{ss}", "name", "page");
+    verify_call(jsontpl_template_render_string(tpl, root, &output, &length));
+    verify(length == 4096 - 6 && strcmp(output + length - 5, "-page") == 0,
+        "page-sized template test failed: %s", output + length - 5);
+    
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_program_free(&program);                                         \
+    jsontpl_template_free(&tpl);                                            \
+    json_decref(root);                                                      \
+} while (0)
+/**
+ * Render errors are reported at the position of the instruction that failed,
+ * including the first one in an else body.
+ */
+int run_offset_test()
+{
+    const char *source = "x\n{% if a %}y{% else %}{= missing =}{% end %}";
+    size_t value = strstr(source, "{= missing") - source + 2;
+    jsontpl_program_t *program = NULL;
+    jsontpl_template_t *tpl = NULL;
+    json_t *root = json_pack("{sb}", "a", 0);
+    
+    verify_call(jsontpl_compile_program(source, strlen(source), NULL, &program));
+    verify(program->ops[0].code == OP_TEXT && program->ops[1].code == OP_IF,
+        "unexpected instructions for %s", source);
+    verify(program->ops[1].offset == (size_t)(strstr(source, "{% if") - source) + 2,
+        "if block at offset %zu", program->ops[1].offset);
+    verify(program->ops[program->ops[1].else_op].offset == value,
+        "else body at offset %zu, expected %zu",
+        program->ops[program->ops[1].else_op].offset, value);
+    
+    verify_call(jsontpl_template_compile(source, &tpl));
+    verify(jsontpl_template_render_file(tpl, root, stdout) == JSONTPL_ERROR_RENDER,
+        "expected a render error from the else body");
+    
+    verify_return();
+}
+
+/* Custom filters for the environment test */
+
+static int test_reverse(json_t *value, jsontpl_output_t *output)
+{
+    const char *str = json_string_value(value);
+    size_t len = strlen(str);
+    
+    while (len--) {
+        jsontpl_output_write(output, &str[len], 1);
+    }
+    return 0;
+}
+
+static int test_double(json_t **value)
+{
+    *value = json_integer(json_integer_value(*value) * 2);
+    return 0;
+}
+
+static int test_fail(json_t **value)
+{
+    return 1;
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_template_free(&tpl);                                            \
+    jsontpl_env_free(&env);                                                 \
+    json_decref(root);                                                      \
+    free(output);                                                           \
+} while (0)
+int run_env_test()
+{
+    char *output = NULL;
+    json_t *root = NULL;
+    jsontpl_template_t *tpl = NULL;
+    jsontpl_env_t *env = jsontpl_env_new();
+    
+    verify_call(jsontpl_env_add_filter(env, "reverse",
+        JSONTPL_FILTER_TYPE(JSON_STRING), NULL, test_reverse));
+    verify_call(jsontpl_env_add_filter(env, "double",
+        JSONTPL_FILTER_TYPE(JSON_INTEGER), test_double, NULL));
+    verify_call(jsontpl_env_add_filter(env, "fail",
+        JSONTPL_FILTER_ANY_TYPE, test_fail, NULL));
+    /* Custom filters shadow the built-in ones */
+    verify_call(jsontpl_env_add_filter(env, "upper",
+        JSONTPL_FILTER_TYPE(JSON_STRING), NULL, test_reverse));
+    
+    verify(jsontpl_env_add_filter(env, "double", JSONTPL_FILTER_ANY_TYPE,
+        test_double, NULL) == JSONTPL_ERROR_FILTER, "expected a duplicate filter error");
+    verify(jsontpl_env_add_filter(env, "bad name", JSONTPL_FILTER_ANY_TYPE,
+        test_double, NULL) == JSONTPL_ERROR_FILTER, "expected an invalid name error");
+    verify(jsontpl_env_add_filter(env, "none", 0, test_double, NULL)
+        == JSONTPL_ERROR_FILTER, "expected an empty type mask error");
+    verify(jsontpl_env_add_filter(env, "none", JSONTPL_FILTER_ANY_TYPE, NULL, NULL)
+        == JSONTPL_ERROR_FILTER, "expected a missing callback error");
+    
+    root = json_pack("{sssis{si}}", "s", "abc", "n", 21, "obj", "cba", 1);
+    verify_call(jsontpl_template_compile_env(env,
+        "{= s | reverse =} {= n | double =} {= s | upper =} {= s | lower =} "
+        "{% if n | double %}{= obj.{s | reverse} =}{% end %} "
+        "{= n | double | double | js =} {= s | reverse | js | lower =}", &tpl));
+    verify_call(jsontpl_template_render_string(tpl, root, &output, NULL));
+    verify(strcmp(output, "cba 42 cba abc 1 84 \"cba\"") == 0, "env test failed: %s", output);
+    jsontpl_template_free(&tpl);
+    
+    verify(jsontpl_template_compile("{= s | reverse =}", &tpl) == JSONTPL_ERROR_COMPILE,
+        "custom filter found without its environment");
+    verify_call(jsontpl_template_compile_env(env, "{= s | double =}", &tpl));
+    verify(jsontpl_template_render_string(tpl, root, &output, NULL) == JSONTPL_ERROR_RENDER,
+        "expected a type error from a custom filter");
+    jsontpl_template_free(&tpl);
+    verify_call(jsontpl_template_compile_env(env, "{= s | fail =}", &tpl));
+    verify(jsontpl_template_render_string(tpl, root, &output, NULL) == JSONTPL_ERROR_RENDER,
+        "expected a custom filter to fail the render");
+    
+    verify_return();
+}
+
+/**
+ * A template and the JSON it should load from the projection test's input,
+ * as printed by json_dumps with JSON_COMPACT | JSON_SORT_KEYS.
+ */
+typedef struct {
+    const char *tpl;
+    const char *projected;
+} project_case;
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_template_free(&tpl);                                            \
+    jsontpl_template_free(&shared[0]);                                      \
+    jsontpl_template_free(&shared[1]);                                      \
+    json_decref(full);                                                      \
+    json_decref(root);                                                      \
+    free(projected);                                                        \
+    free(expected);                                                         \
+    free(output);                                                           \
+} while (0)
+int run_project_test()
+{
+    const char *json = "{\"a\": {\"b\": 1, \"c\": [1, 2]}, \"k\": \"b\", "
+        "\"list\": [{\"x\": 1, \"y\": 2}, {\"x\": 3, \"y\": 4}], "
+        "\"skip\": {\"deep\": [1, {\"z\": \"\\u00e9\"}, 2.5e3, null]}}";
+    const project_case cases[] = {
+        {"{= a.b =}", "{\"a\":{\"b\":1}}"},
+        {"{% foreach list: i %}{= i.x =}{% end %}", "{\"list\":[{\"x\":1},{\"x\":3}]}"},
+        {"{% foreach list: a %}{= a.y =}{% end %}", "{\"list\":[{\"y\":2},{\"y\":4}]}"},
+        {"{% foreach a: k -> v %}{= k =} {% end %}", "{\"a\":{\"b\":1,\"c\":[]}}"},
+        {"{= a.{k} =} {= list | count =}",
+            "{\"a\":{\"b\":1,\"c\":[1,2]},\"k\":\"b\","
+            "\"list\":[{\"x\":1,\"y\":2},{\"x\":3,\"y\":4}]}"},
+        {"{% if a %}{= a.b =}{% else %}{= k =}{% end %}",
+            "{\"a\":{\"b\":1,\"c\":[1,2]},\"k\":\"b\"}"},
+        {NULL, NULL},
+    };
+    const char *bad_json[] = {
+        "{\"a\": [1,]}", "{\"a\": 01}", "{\"a\": \"\\x\"}", "{\"a\": tru}",
+        "{\"k\": 1, \"k\": 2}", "{\"k\": 1} 2", "[]", NULL,
+    };
+    const char *dup_json = "{\"k\": 1, \"s\": {\"d\": 1, \"d\": 2}}";
+    const char **bad;
+    const project_case *test;
+    jsontpl_template_t *shared[2] = {NULL, NULL};
+    char *projected = NULL, *expected = NULL, *output = NULL;
+    json_t *full = NULL, *root = NULL;
+    jsontpl_template_t *tpl = NULL;
+    
+    full = json_loads(json, 0, NULL);
+    verify(full, "projection test: invalid JSON");
+    
+    for (test = &cases[0]; test->tpl; test++) {
+        verify_call(jsontpl_template_compile(test->tpl, &tpl));
+        verify_call(jsontpl_template_parse_json(tpl, json, strlen(json), &root));
+        projected = json_dumps(root, JSON_COMPACT | JSON_SORT_KEYS);
+        verify(strcmp(projected, test->projected) == 0,
+            "\"%s\" loaded the wrong values: %s", test->tpl, projected);
+        
+        /* Rendering the projected root gives the same output */
+        verify_call(jsontpl_template_render_string(tpl, full, &expected, NULL));
+        verify_call(jsontpl_template_render_string(tpl, root, &output, NULL));
+        verify(strcmp(expected, output) == 0, "\"%s\" rendered differently: %s",
+            test->tpl, output);
+        
+        jsontpl_template_free(&tpl);
+        json_decref(root);
+        root = NULL;
+        free(projected);
+        free(expected);
+        free(output);
+        projected = expected = output = NULL;
+    }
+    
+    /* Parsing once for several templates keeps what any of them needs */
+    verify_call(jsontpl_template_compile("{% foreach a: k -> v %}{= k =}{% end %}",
+        &shared[0]));
+    verify_call(jsontpl_template_compile("{= a.c | count =} {= list | count =}",
+        &shared[1]));
+    verify_call(jsontpl_templates_parse_json(shared, 2, json, strlen(json), &root));
+    projected = json_dumps(root, JSON_COMPACT | JSON_SORT_KEYS);
+    verify(strcmp(projected, "{\"a\":{\"b\":1,\"c\":[1,2]},"
+        "\"list\":[{\"x\":1,\"y\":2},{\"x\":3,\"y\":4}]}") == 0,
+        "shared parse loaded the wrong values: %s", projected);
+    free(projected);
+    projected = NULL;
+    json_decref(root);
+    root = NULL;
+    
+    /* A name starting with a variable could reference anything */
+    verify_call(jsontpl_template_compile("{= {k} =}", &tpl));
+    verify_call(jsontpl_template_parse_json(tpl, json, strlen(json), &root));
+    verify(json_equal(root, full), "variable name didn't load the whole input");
+    json_decref(root);
+    root = NULL;
+    jsontpl_template_free(&shared[1]);
+    shared[1] = tpl;
+    tpl = NULL;
+    verify_call(jsontpl_templates_parse_json(shared, 2, json, strlen(json), &root));
+    verify(json_equal(root, full), "shared parse didn't load the whole input");
+    json_decref(root);
+    root = NULL;
+    
+    /* Skipped values are still checked for well-formed syntax */
+    jsontpl_template_free(&tpl);
+    verify_call(jsontpl_template_compile("{= k =}", &tpl));
+    for (bad = &bad_json[0]; *bad; bad++) {
+        verify(jsontpl_template_parse_json(tpl, *bad, strlen(*bad), &root)
+            == JSONTPL_ERROR_LOAD, "expected a load error from %s", *bad);
+    }
+    
+    /* Duplicate keys are only caught when the whole input is loaded */
+    verify_call(jsontpl_template_parse_json(tpl, dup_json, strlen(dup_json),
+        &root));
+    verify(jsontpl_string((char *)dup_json, "{= k =}", &output)
+        == JSONTPL_ERROR_LOAD, "expected a load error from %s", dup_json);
+    
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_template_free(&tpl);                                            \
+    if (input) fclose(input);                                               \
+    if (output) fclose(output);                                             \
+} while (0)
+int run_ndjson_test()
+{
+    const char *records = "{\"a\": 1, \"b\": [1, 2]}\n\n{\"a\": \"x\", \"b\": []}\r\n"
+        "  \n{\"a\": true, \"b\": {\"c\": 3}}";
+    const char *expected = "1:2, x:0, true:1";
+    char buffer[64];
+    size_t count, len;
+    FILE *input = tmpfile(), *output = tmpfile();
+    jsontpl_template_t *tpl = NULL;
+    
+    verify(input && output, "couldn't create temporary files");
+    fputs(records, input);
+    rewind(input);
+    
+    verify_call(jsontpl_template_compile("{= a =}:{= b | count =}", &tpl));
+    verify_call(jsontpl_template_render_ndjson(tpl, input, output, ", ", &count));
+    verify(count == 3, "expected 3 records, got %zu", count);
+    rewind(output);
+    len = fread(buffer, 1, sizeof(buffer) - 1, output);
+    buffer[len] = '\0';
+    verify(strcmp(buffer, expected) == 0, "ndjson test failed: %s", buffer);
+    
+    /* A bad record stops the stream and reports how far it got */
+    rewind(input);
+    fputs("{\"a\": 1, \"b\": []}\n{\"a\": 2, \"b\": [}\n", input);
+    rewind(input);
+    verify(jsontpl_template_render_ndjson(tpl, input, output, NULL, &count)
+        == JSONTPL_ERROR_LOAD && count == 1, "expected a load error after 1 record");
+    
+    verify_return();
+}
+
+/**
+ * Render the template to a temporary file and return the status, assigning
+ * `output` to whatever was written, even if rendering failed.
+ */
+static int render_partial(jsontpl_template_t *tpl, json_t *root, char **output)
+{
+    int status;
+    long len;
+    FILE *file = tmpfile();
+    
+    status = jsontpl_template_render_file(tpl, root, file);
+    fflush(file);
+    len = ftell(file);
+    rewind(file);
+    *output = malloc(len + 1);
+    (*output)[fread(*output, 1, len, file)] = '\0';
+    fclose(file);
+    
+    return status;
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_template_free(&tpl);                                            \
+    jsontpl_pool_free(&pool);                                               \
+    json_decref(root);                                                      \
+    free(serial);                                                           \
+    free(parallel);                                                         \
+} while (0)
+int run_parallel_test()
+{
+    const char *tpls[] = {
+        "{% foreach outer: o %}[{% foreach rows: r %}{= o =}{= r.n =}{= r.s | upper =},{% end %}]{% end %}",
+        "{% foreach rows: r %}{% foreach r.l: x %}{= x =}{% end %}{% if r.n %}{= r.s | js =}{% end %};{% end %}",
+        "{% foreach rows: r %}{= r.n =}{% if r.bad %}{= r.bad | upper =}{% end %}{% end %}",
+        NULL,
+    };
+    const char **tpl_source;
+    char *serial = NULL, *parallel = NULL;
+    int serial_status, parallel_status;
+    json_t *root = json_pack("{s[ii]s[]}", "outer", 1, 2, "rows");
+    json_t *rows = json_object_get(root, "rows");
+    jsontpl_template_t *tpl = NULL;
+    jsontpl_pool_t *pool = jsontpl_pool_new(4);
+    int i;
+    
+    /* Enough rows for several waves of chunks, with one bad row near the end */
+    for (i = 0; i < 5000; i++) {
+        json_array_append_new(rows, json_pack("{sisss[ii]}", "n", i, "s", "ab", "l", i, -i));
+    }
+    json_object_set_new(json_array_get(rows, 4321), "bad", json_integer(1));
+    
+    for (tpl_source = &tpls[0]; *tpl_source; tpl_source++) {
+        verify_call(jsontpl_template_compile(*tpl_source, &tpl));
+        serial_status = render_partial(tpl, root, &serial);
+        jsontpl_template_set_pool(tpl, pool, 1);
+        parallel_status = render_partial(tpl, root, &parallel);
+        verify(serial_status == parallel_status, "parallel render status differs");
+        /* Even a failed render writes the same output up to the failure */
+        verify(strcmp(serial, parallel) == 0, "parallel render differs for %s", *tpl_source);
+        jsontpl_template_free(&tpl);
+        free(serial);
+        free(parallel);
+        serial = parallel = NULL;
+    }
+    
+    verify_return();
+}
+
+/**
+ * State shared by the threads of the concurrency test.  Every thread renders
+ * the same templates against the same root and compares the results with the
+ * ones rendered beforehand on the main thread.
+ */
+typedef struct {
+    json_t *root;
+    jsontpl_template_t *tpls[3];
+    char *expected[3];
+} thread_test;
+
+#define THREAD_TEST_THREADS 8
+#define THREAD_TEST_RENDERS 200
+
+#undef verify_cleanup
+#define verify_cleanup free(output)
+static int run_thread(thread_test *t)
+{
+    int i;
+    char *output = NULL;
+    
+    for (i = 0; i < THREAD_TEST_RENDERS; i++) {
+        verify_call(jsontpl_template_render_string(t->tpls[i % 3], t->root, &output, NULL));
+        verify(strcmp(output, t->expected[i % 3]) == 0,
+            "concurrent render differs: %s", output);
+        free(output);
+        output = NULL;
+    }
+    
+    verify_return();
+}
+
+static void *run_thread_main(void *t)
+{
+    return run_thread(t) ? t : NULL;
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    for (i = 0; i < 3; i++) {                                               \
+        jsontpl_template_free(&t.tpls[i]);                                  \
+        free(t.expected[i]);                                                \
+    }                                                                       \
+    json_decref(t.root);                                                    \
+    free(before);                                                           \
+    free(after);                                                            \
+} while (0)
+int run_thread_test()
+{
+    int i;
+    char failed = 0;
+    char *before = NULL, *after = NULL;
+    pthread_t threads[THREAD_TEST_THREADS];
+    void *result;
+    thread_test t = {NULL, {NULL, NULL, NULL}, {NULL, NULL, NULL}};
+    const char *tpls[3] = {
+        "{% foreach hosts: host %}{= host.name | upper =}:{= host.port =} {% end %}",
+        "{% foreach env: k -> v %}{= k =}={= v =}{% if v %}!{% end %} {% end %}",
+        "{= hosts | count =} {= names | english =} {= env.{key}|js =} {= hosts | js =}",
+    };
+    
+    t.root = json_loads("{\"hosts\": [{\"name\": \"a\", \"port\": 80}, "
+        "{\"name\": \"b\", \"port\": 443}], \"env\": {\"x\": \"1\", \"y\": \"\"}, "
+        "\"names\": [\"p\", \"q\", \"r\"], \"key\": \"x\"}", 0, NULL);
+    verify(t.root, "thread test: invalid JSON");
+    before = json_dumps(t.root, JSON_SORT_KEYS);
+    
+    for (i = 0; i < 3; i++) {
+        verify_call(jsontpl_template_compile(tpls[i], &t.tpls[i]));
+        verify_call(jsontpl_template_render_string(t.tpls[i], t.root, &t.expected[i], NULL));
+    }
+    
+    for (i = 0; i < THREAD_TEST_THREADS; i++) {
+        verify(pthread_create(&threads[i], NULL, run_thread_main, &t) == 0,
+            "couldn't start thread");
+    }
+    for (i = 0; i < THREAD_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        failed |= result != NULL;
+    }
+    verify(!failed, "concurrent rendering failed");
+    
+    after = json_dumps(t.root, JSON_SORT_KEYS);
+    verify(strcmp(before, after) == 0, "root was modified by concurrent renders");
+    verify(t.root->refcount == 1, "root's reference count was touched");
+    
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+static int write_file(const char *filename, const char *contents)
+{
+    FILE *file = fopen(filename, "wb");
+    
+    verify(file, "couldn't write %s", filename);
+    fputs(contents, file);
+    fclose(file);
+    
+    verify_return();
+}
+
+#define CACHE_TEST_THREADS 8
+#define CACHE_TEST_GETS 2000
+
+typedef struct {
+    jsontpl_cache_t *cache;
+    json_t *root;
+} cache_test;
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_cache_release(t->cache, &cached);                               \
+    free(output);                                                           \
+} while (0)
+static int run_cache_thread(cache_test *t)
+{
+    int i;
+    char *output = NULL;
+    jsontpl_cached_t *cached = NULL;
+    
+    for (i = 0; i < CACHE_TEST_GETS; i++) {
+        verify_call(jsontpl_cache_get(t->cache, "test_cache.tpl", &cached));
+        verify_call(jsontpl_template_render_string(jsontpl_cached_template(cached),
+            t->root, &output, NULL));
+        verify(strcmp(output, "v1 x") == 0 || strcmp(output, "version 2 x") == 0,
+            "cached template rendered %s", output);
+        jsontpl_cache_release(t->cache, &cached);
+        free(output);
+        output = NULL;
+    }
+    
+    verify_return();
+}
+
+static void *run_cache_thread_main(void *t)
+{
+    return run_cache_thread(t) ? t : NULL;
+}
+
+#undef verify_cleanup
+#define verify_cleanup
+/* Replace the file in one step, as a deployment would, so readers never see
+   it half-written. */
+static int replace_file(const char *filename, const char *contents)
+{
+    verify_call(write_file("test_cache.tmp", contents));
+    verify(rename("test_cache.tmp", filename) == 0, "couldn't replace %s", filename);
+    verify_return();
+}
+
+#undef verify_cleanup
+#define verify_cleanup do {                                                 \
+    jsontpl_cache_release(cache, &first);                                   \
+    jsontpl_cache_release(cache, &second);                                  \
+    jsontpl_cache_release(cache, &third);                                   \
+    jsontpl_cache_free(&cache);                                             \
+    json_decref(root);                                                      \
+    free(output);                                                           \
+    remove("test_cache.tpl");                                               \
+    remove("test_cache_a.tpl");                                             \
+    remove("test_cache_b.tpl");                                             \
+    remove("test_cache_c.tpl");                                             \
+} while (0)
+int run_cache_test()
+{
+    int i;
+    char failed = 0;
+    jsontpl_cache_t *cache = jsontpl_cache_new(NULL);
+    jsontpl_cached_t *first = NULL, *second = NULL, *third = NULL;
+    jsontpl_cache_stats_t stats;
+    json_t *root = json_pack("{ss}", "name", "x");
+    char *output = NULL;
+    pthread_t threads[CACHE_TEST_THREADS];
+    void *result;
+    cache_test t;
+    
+    verify_call(write_file("test_cache.tpl", "v1 {= name =}"));
+    verify_call(jsontpl_cache_get(cache, "test_cache.tpl", &first));
+    verify_call(jsontpl_cache_get(cache, "test_cache.tpl", &second));
+    verify(jsontpl_cached_template(first) == jsontpl_cached_template(second),
+        "unchanged template was compiled again");
+    jsontpl_cache_release(cache, &second);
+    
+    /* A changed file is compiled again, while the old version stays usable */
+    verify_call(write_file("test_cache.tpl", "version 2 {= name =}"));
+    verify_call(jsontpl_cache_get(cache, "test_cache.tpl", &third));
+    verify_call(jsontpl_template_render_string(jsontpl_cached_template(third),
+        root, &output, NULL));
+    verify(strcmp(output, "version 2 x") == 0, "changed template not reloaded: %s", output);
+    free(output);
+    output = NULL;
+    verify_call(jsontpl_template_render_string(jsontpl_cached_template(first),
+        root, &output, NULL));
+    verify(strcmp(output, "v1 x") == 0, "old version of template changed: %s", output);
+    
+    jsontpl_cache_stats(cache, &stats);
+    verify(stats.hits == 1 && stats.misses == 1 && stats.reloads == 1,
+        "wrong cache counters: %lu hits, %lu misses, %lu reloads",
+        stats.hits, stats.misses, stats.reloads);
+    
+    jsontpl_cache_release(cache, &first);
+    jsontpl_cache_release(cache, &third);
+    
+    /* Lookups race with the file being replaced; every render sees either
+       version, whole */
+    t.cache = cache;
+    t.root = root;
+    for (i = 0; i < CACHE_TEST_THREADS; i++) {
+        verify(pthread_create(&threads[i], NULL, run_cache_thread_main, &t) == 0,
+            "couldn't start thread");
+    }
+    for (i = 0; i < 50; i++) {
+        failed |= replace_file("test_cache.tpl", i % 2 ? "version 2 {= name =}" :
+            "v1 {= name =}") != 0;
+    }
+    for (i = 0; i < CACHE_TEST_THREADS; i++) {
+        pthread_join(threads[i], &result);
+        failed |= result != NULL;
+    }
+    verify(!failed, "concurrent cache lookups failed");
+    
+    remove("test_cache.tpl");
+    verify(jsontpl_cache_get(cache, "test_cache.tpl", &second) == JSONTPL_ERROR_LOAD,
+        "expected a load error for a removed template");
+    
+    /* Over budget, the least recently used file is dropped */
+    jsontpl_cache_free(&cache);
+    cache = jsontpl_cache_new(NULL);
+    verify_call(write_file("test_cache_a.tpl", "a {= name =}"));
+    verify_call(write_file("test_cache_b.tpl", "b {= name =}"));
+    verify_call(write_file("test_cache_c.tpl", "c {= name =}"));
+    verify_call(jsontpl_cache_get(cache, "test_cache_a.tpl", &first));
+    jsontpl_cache_stats(cache, &stats);
+    jsontpl_cache_set_budget(cache, stats.bytes * 2);
+    verify_call(jsontpl_cache_get(cache, "test_cache_b.tpl", &second));
+    jsontpl_cache_release(cache, &first);
+    verify_call(jsontpl_cache_get(cache, "test_cache_a.tpl", &first));
+    verify_call(jsontpl_cache_get(cache, "test_cache_c.tpl", &third));
+    jsontpl_cache_stats(cache, &stats);
+    verify(stats.evictions == 1 && stats.misses == 3 && stats.hits == 1,
+        "wrong counters after eviction: %lu evictions, %lu misses, %lu hits",
+        stats.evictions, stats.misses, stats.hits);
+    
+    /* The evicted file's template is still usable by whoever checked it out */
+    free(output);
+    output = NULL;
+    verify_call(jsontpl_template_render_string(jsontpl_cached_template(second),
+        root, &output, NULL));
+    verify(strcmp(output, "b x") == 0, "evicted template rendered %s", output);
+    jsontpl_cache_release(cache, &second);
+    verify_call(jsontpl_cache_get(cache, "test_cache_b.tpl", &second));
+    jsontpl_cache_stats(cache, &stats);
+    verify(stats.misses == 4, "evicted template wasn't compiled again");
+    
+    verify_return();
+}
+
 #undef verify_cleanup
 #define verify_cleanup
 int main(int argc, char *argv[])
@@ -183,6 +908,16 @@ int main(int argc, char *argv[])
         verify_call(run_test(test));
     }
     
+    verify_log_("Expecting errors from the template API test:\n");
+    verify_call(run_template_test());
+    verify_call(run_offset_test());
+    verify_call(run_env_test());
+    verify_call(run_project_test());
+    verify_call(run_ndjson_test());
+    verify_call(run_thread_test());
+    verify_call(run_parallel_test());
+    verify_call(run_cache_test());
+    
     verify_log_("All tests passed");
     verify_return();
 }
@@ -63,6 +63,16 @@
     }                                                                       \
 } while (0)
 
+/* Same as verify_call, but return the given code instead of a line number.
+   Use this at API boundaries that report which phase of the work failed. */
+#define verify_call_code(expr, code) do {                                   \
+    if (expr) {                                                             \
+        verify_tb_();                                                       \
+        verify_cleanup;                                                     \
+        return (code);                                                      \
+    }                                                                       \
+} while (0)
+
 /* Same as verify_call_hint, but provide extra information about the call via
    printf arguments following the function call. */
 #define verify_call_hint(expr, ...) do {                                    \
@@ -73,6 +83,16 @@
     }                                                                       \
 } while (0)
 
+/* Same as verify_call_hint, but return the given code instead of a line
+   number, like verify_call_code. */
+#define verify_call_hint_code(expr, code, ...) do {                         \
+    if (expr) {                                                             \
+        verify_tb_hint_(__VA_ARGS__);                                       \
+        verify_cleanup;                                                     \
+        return (code);                                                      \
+    }                                                                       \
+} while (0)
+
 /* Verify that the predicate is true.  If it is false, the remaining arguments
    are printf'd to VERIFY_LOG_FILE. */
 #define verify(predicate, ...) do {                                         \